@@ -0,0 +1,17 @@
+#include "user.h"
+
+/* 物理页分配速度：第一次写 .bss 中的每一页都会缺页，内核分配一个清零的物理页并建立映射。 */
+#define PAGES        512
+#define TICKS_PER_MS 10000
+
+uint8_t area[PAGES * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+void main(void) {
+    volatile uint8_t *p = area;
+    uint32_t start = READ_TIME();
+    for (int i = 0; i < PAGES; i++)
+        p[i * PAGE_SIZE] = 1;
+    uint32_t ticks = READ_TIME() - start;
+    printf("bench: page_fault_alloc %d ns\n", ticks * 100 / PAGES);
+    printf("bench: page_alloc_rate %d pages/ms\n", PAGES * TICKS_PER_MS / (ticks ? ticks : 1));
+}
@@ -0,0 +1,194 @@
+#!/usr/bin/env python3
+# Headless benchmark runner. Builds everything with run.sh, boots QEMU with -icount so
+# guest time is derived from the instruction count (results are deterministic), runs
+# each benchmark program from the shell, parses the "bench: <name> <value> <unit>"
+# lines from the serial console and compares them against bench_baseline.json.
+#
+# The first run on a machine writes bench_baseline.json (there is none in the repository:
+# the numbers depend on the host QEMU). Commit it, or rerun with --update-baseline after an
+# intended change. Later runs compare against it.
+#
+# The single-hart programs run in one boot with -smp 1 (ctxbench needs both processes on
+# one hart). SMP_PROGRAMS run in a second boot with --smp-harts harts and without -icount:
+# with -icount QEMU runs the harts one at a time on a shared virtual clock, so parallel
+# speedup would not show. Those results are wall-clock based and noisier.
+#
+# usage: python3 bench.py [--no-build] [--update-baseline] [--threshold PCT] [--smp-harts N] [--files N] [--disk-mb M]
+#                         [programs...]
+# Exits with status 1 if any metric regressed by more than the threshold.
+#
+# --files appends N small files to the archive, so fs_writefile can be compared across
+# archive sizes: with incremental fs_flush it should not grow with N. --disk-mb appends one
+# large file; the boot metrics (fs_mount, boot_to_shell) come from the kernel's boot messages
+# and with the lazy mount should depend on the number of files, not on their size.
+import argparse
+import io
+import json
+import os
+import re
+import select
+import shutil
+import subprocess
+import sys
+import tarfile
+import tempfile
+import time
+
+PROGRAMS = ["syscallbench.elf", "ctxbench.elf", "allocbench.elf", "fsbench.elf", "forkbench.elf"]
+SMP_PROGRAMS = ["smpbench.elf"]
+BASELINE = "bench_baseline.json"
+PROMPT = b"> "
+RESULT = re.compile(r"^bench: (\S+) (-?\d+) (\S+)\s*$", re.MULTILINE)
+BOOT_RESULTS = {  # kernel boot messages -> metric name
+    "fs_mount": re.compile(r"^mounted \d+ files in (\d+) us", re.MULTILINE),
+    "boot_to_shell": re.compile(r"^boot: first switch to shell (\d+) us after reset", re.MULTILINE),
+}
+
+
+class Guest:
+    def __init__(self, args, disk, smp, icount):
+        cmd = [os.environ.get("QEMU", "qemu-system-riscv32"),
+               "-machine", "virt", "-smp", str(smp), "-bios", "default",
+               "-display", "none", "-serial", "stdio", "-monitor", "none", "--no-reboot",
+               "-drive", "id=drive0,file=%s,format=raw,if=none" % disk,
+               "-device", "virtio-blk-device,drive=drive0,bus=virtio-mmio-bus.0",
+               "-kernel", "kernel.elf"]
+        if icount:
+            cmd += ["-icount", "shift=%d,align=off,sleep=off" % args.icount]
+        self.proc = subprocess.Popen(cmd, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        self.timeout = args.timeout
+
+    def expect(self, marker):
+        """Read serial output until it ends with marker; return everything read."""
+        out = b""
+        deadline = time.time() + self.timeout
+        while not out.endswith(marker):
+            left = deadline - time.time()
+            if left <= 0 or not select.select([self.proc.stdout], [], [], left)[0]:
+                raise TimeoutError("timed out waiting for %r; output so far:\n%s" % (marker, out.decode(errors="replace")))
+            chunk = os.read(self.proc.stdout.fileno(), 4096)
+            if not chunk:
+                raise EOFError("QEMU exited; output so far:\n%s" % out.decode(errors="replace"))
+            out += chunk
+        return out.decode(errors="replace")
+
+    def run(self, command):
+        self.proc.stdin.write(command.encode() + b"\n")
+        self.proc.stdin.flush()
+        return self.expect(b"\n" + PROMPT)
+
+    def close(self):
+        self.proc.kill()
+        self.proc.wait()
+
+
+def fill_disk(disk, files, megabytes):
+    """Append filler files to the archive copy, then leave room for files to grow."""
+    with tarfile.open(disk, "a", format=tarfile.USTAR_FORMAT) as tar:
+        for i in range(files):
+            info = tarfile.TarInfo("fill%04d.txt" % i)
+            info.size = 512
+            tar.addfile(info, io.BytesIO(b"x" * info.size))
+        if megabytes:
+            info = tarfile.TarInfo("fill.bin")
+            info.size = megabytes << 20
+            tar.addfile(info, io.BytesIO(bytes(info.size)))
+    os.truncate(disk, os.path.getsize(disk) + (1 << 20))
+
+
+def run_boot(args, programs, smp, icount, boot_metrics):
+    """Boot a guest on a fresh copy of disk.tar, run programs from the shell and collect results."""
+    results = {}
+    with tempfile.TemporaryDirectory() as tmp:
+        disk = os.path.join(tmp, "disk.tar")
+        shutil.copy("disk.tar", disk)
+        if args.files or args.disk_mb:
+            fill_disk(disk, args.files, args.disk_mb)
+        guest = Guest(args, disk, smp, icount)
+        try:
+            boot = guest.expect(PROMPT)
+            for name, pattern in BOOT_RESULTS.items() if boot_metrics else ():
+                m = pattern.search(boot)
+                if m:
+                    results[name] = (int(m.group(1)), "us")
+            for prog in programs:
+                output = guest.run(prog)
+                found = RESULT.findall(output)
+                if not found:
+                    print("%s: no results\n%s" % (prog, output), file=sys.stderr)
+                for name, value, unit in found:
+                    results[name] = (int(value), unit)
+        finally:
+            guest.close()
+    return results
+
+
+def write_baseline(results):
+    with open(BASELINE, "w") as f:
+        json.dump({k: {"value": v, "unit": u} for k, (v, u) in results.items()}, f, indent=2)
+        f.write("\n")
+
+
+def lower_is_better(unit):
+    return unit.startswith(("ns", "us", "ms")) or unit == "pages"
+
+
+def compare(results, baseline, threshold):
+    regressed = False
+    print("%-20s %16s %16s %8s" % ("metric", "baseline", "result", "change"))
+    for name, (value, unit) in results.items():
+        if name not in baseline:
+            print("%-20s %16s %16s %8s" % (name, "-", "%d %s" % (value, unit), "new"))
+            continue
+        base = baseline[name]["value"]
+        if base:
+            change = (value - base) * 100.0 / base
+        else:  # e.g. a leak count of 0: any change at all counts
+            change = 0.0 if value == 0 else (100.0 if value > 0 else -100.0)
+        worse = change > threshold if lower_is_better(unit) else change < -threshold
+        regressed |= worse
+        print("%-20s %16s %16s %+7.1f%%%s" % (name, "%d %s" % (base, unit), "%d %s" % (value, unit),
+                                             change, "  REGRESSION" if worse else ""))
+    for name in baseline:
+        if name not in results:
+            print("%-20s missing from this run" % name)
+            regressed = True
+    return regressed
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("programs", nargs="*", default=PROGRAMS + SMP_PROGRAMS)
+    parser.add_argument("--no-build", action="store_true", help="use the existing kernel.elf and disk.tar")
+    parser.add_argument("--update-baseline", action="store_true", help="store this run as the new baseline")
+    parser.add_argument("--threshold", type=float, default=5.0, help="allowed change in percent")
+    parser.add_argument("--smp-harts", type=int, default=4, help="number of harts for SMP_PROGRAMS")
+    parser.add_argument("--icount", type=int, default=0, help="-icount shift: 2^N ns per instruction")
+    parser.add_argument("--timeout", type=float, default=300, help="seconds to wait for each program")
+    parser.add_argument("--files", type=int, default=0, help="append N filler files to the disk copy")
+    parser.add_argument("--disk-mb", type=int, default=4, help="append one filler file of M MiB to the disk copy")
+    args = parser.parse_args()
+
+    if not args.no_build:
+        subprocess.run(["./run.sh"], env=dict(os.environ, BUILD_ONLY="1"), check=True)
+
+    single = [p for p in args.programs if p not in SMP_PROGRAMS]
+    smp = [p for p in args.programs if p in SMP_PROGRAMS]
+    results = run_boot(args, single, 1, True, True)
+    if smp:
+        results.update(run_boot(args, smp, args.smp_harts, False, False))
+
+    if args.update_baseline or not os.path.exists(BASELINE):
+        for name, (value, unit) in results.items():
+            print("%-20s %16s" % (name, "%d %s" % (value, unit)))
+        write_baseline(results)
+        print("baseline written to %s; later runs compare against it" % BASELINE)
+        return 0
+
+    with open(BASELINE) as f:
+        baseline = json.load(f)
+    return 1 if compare(results, baseline, args.threshold) else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
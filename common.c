@@ -1,29 +1,122 @@
 #include "common.h"
 
+typedef uint32_t __attribute__((may_alias)) word_t; // 按字访问任意类型的内存
+
+#define WORD_ONES  0x01010101u
+#define WORD_HIGHS 0x80808080u
+#define HAS_ZERO_BYTE(w) (((w) - WORD_ONES) & ~(w) & WORD_HIGHS) // 字中是否有为 0 的字节
+
+/*
+ * memset: 先逐字节对齐到 4 字节边界，然后每次写 8 个字（展开），再逐字写，最后逐字节处理剩下的部分。
+ */
 void *memset(void *buf, char c, size_t n) {
     uint8_t *p = (uint8_t *) buf;
+    while (n && !is_aligned((uint32_t) p, 4)) {
+        *p++ = c;
+        n--;
+    }
+
+    uint32_t word = (uint8_t) c * WORD_ONES;
+    word_t *w = (word_t *) p;
+    for (; n >= 32; n -= 32, w += 8) {
+        w[0] = word; w[1] = word; w[2] = word; w[3] = word;
+        w[4] = word; w[5] = word; w[6] = word; w[7] = word;
+    }
+    for (; n >= 4; n -= 4)
+        *w++ = word;
+
+    p = (uint8_t *) w;
     while (n--)
         *p++ = c;
     return buf;
 }
 
+/*
+ * memcpy: 先把 dst 逐字节对齐到 4 字节边界，然后按字复制。
+ * src 与 dst 同样对齐时每次复制 8 个字（展开）；不同时按对齐的字读取 src，再移位拼接，
+ * 避免非对齐访问（RISC-V 上可能陷入 SBI 模拟，非常慢）。
+ */
 void *memcpy(void *dst, const void *src, size_t n) {
     uint8_t *d = (uint8_t *) dst;
     const uint8_t *s = (const uint8_t *) src;
+    while (n && !is_aligned((uint32_t) d, 4)) {
+        *d++ = *s++;
+        n--;
+    }
+
+    word_t *wd = (word_t *) d;
+    if (is_aligned((uint32_t) s, 4)) {
+        const word_t *ws = (const word_t *) s;
+        for (; n >= 32; n -= 32, wd += 8, ws += 8) {
+            wd[0] = ws[0]; wd[1] = ws[1]; wd[2] = ws[2]; wd[3] = ws[3];
+            wd[4] = ws[4]; wd[5] = ws[5]; wd[6] = ws[6]; wd[7] = ws[7];
+        }
+        for (; n >= 4; n -= 4)
+            *wd++ = *ws++;
+        s = (const uint8_t *) ws;
+    } else if (n >= 4) {
+        // 读取的对齐字与要用到的字节在同一个字里，不会越过页边界
+        uint32_t shift = ((uint32_t) s & 3) * 8;
+        const word_t *ws = (const word_t *) ((uint32_t) s & ~3u);
+        uint32_t cur = *ws++;
+        for (; n >= 4; n -= 4, s += 4) {
+            uint32_t next = *ws++;
+            *wd++ = (cur >> shift) | (next << (32 - shift)); // 小端序：低地址的字节在低位
+            cur = next;
+        }
+    }
+
+    d = (uint8_t *) wd;
     while (n--)
         *d++ = *s++;
     return dst;
 }
 
+/*
+ * strcpy: src 和 dst 同样对齐时，对齐之后按字复制，直到字中出现 '\0'，再逐字节复制结尾。
+ */
 char *strcpy(char *dst, const char *src) {
     char *d = dst;
+    if (is_aligned((uint32_t) d ^ (uint32_t) src, 4)) {
+        for (; !is_aligned((uint32_t) src, 4); src++, d++) {
+            if (!(*d = *src))
+                return dst;
+        }
+
+        word_t *wd = (word_t *) d;
+        const word_t *ws = (const word_t *) src;
+        while (!HAS_ZERO_BYTE(*ws))
+            *wd++ = *ws++;
+        d = (char *) wd;
+        src = (const char *) ws;
+    }
+
     while (*src)
         *d++ = *src++;
     *d = '\0';
     return dst;
 }
 
+/*
+ * strcmp: s1 和 s2 同样对齐时，对齐之后按字比较，遇到不同的字或者含有 '\0' 的字再逐字节比较。
+ */
 int strcmp(const char *s1, const char *s2) {
+    if (is_aligned((uint32_t) s1 ^ (uint32_t) s2, 4)) {
+        for (; !is_aligned((uint32_t) s1, 4); s1++, s2++) {
+            if (!*s1 || *s1 != *s2)
+                return *(unsigned char *)s1 - *(unsigned char *)s2;
+        }
+
+        const word_t *w1 = (const word_t *) s1;
+        const word_t *w2 = (const word_t *) s2;
+        while (*w1 == *w2 && !HAS_ZERO_BYTE(*w1)) {
+            w1++;
+            w2++;
+        }
+        s1 = (const char *) w1;
+        s2 = (const char *) w2;
+    }
+
     while (*s1 && *s2) {
         if (*s1 != *s2)
             break;
@@ -34,9 +127,112 @@ int strcmp(const char *s1, const char *s2) {
     return *(unsigned char *)s1 - *(unsigned char *)s2;
 }
 
-void putchar(char ch);
+#define BENCH_ROUNDS 16
+#define BARRIER() __asm__ __volatile__("" ::: "memory") // 防止编译器把逐字节的循环换成 memset/memcpy
+
+uint32_t bench_per_kb(uint32_t cycles, size_t size) { // 平均每轮、每 KB 的周期数
+    return cycles / BENCH_ROUNDS * 1024 / size;
+}
+
+/*
+ * mem_bench: 用 rdcycle 测量 memset/memcpy/strcpy/strcmp 每 KB 的周期数，并与逐字节的循环比较。
+ * buf1、buf2 至少 size + 4 字节，4 字节对齐；内核和用户程序都可以调用。
+ */
+void mem_bench(void *buf1, void *buf2, size_t size) {
+    uint8_t *a = (uint8_t *) buf1, *b = (uint8_t *) buf2;
+    uint32_t start, fast, slow, unaligned;
+
+    start = READ_CYCLE();
+    for (int r = 0; r < BENCH_ROUNDS; r++)
+        memset(a, r, size);
+    fast = READ_CYCLE() - start;
+    start = READ_CYCLE();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (size_t i = 0; i < size; i++) {
+            a[i] = r;
+            BARRIER();
+        }
+    }
+    slow = READ_CYCLE() - start;
+    printf("memset: %d cycles/KB (byte loop: %d)\n",
+           bench_per_kb(fast, size), bench_per_kb(slow, size));
+
+    start = READ_CYCLE();
+    for (int r = 0; r < BENCH_ROUNDS; r++)
+        memcpy(b, a, size);
+    fast = READ_CYCLE() - start;
+    start = READ_CYCLE();
+    for (int r = 0; r < BENCH_ROUNDS; r++)
+        memcpy(b, a + 1, size);
+    unaligned = READ_CYCLE() - start;
+    start = READ_CYCLE();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (size_t i = 0; i < size; i++) {
+            b[i] = a[i];
+            BARRIER();
+        }
+    }
+    slow = READ_CYCLE() - start;
+    printf("memcpy: %d cycles/KB, %d unaligned (byte loop: %d)\n", bench_per_kb(fast, size),
+           bench_per_kb(unaligned, size), bench_per_kb(slow, size));
+
+    memset(a, 'x', size);
+    a[size - 1] = '\0';
+    start = READ_CYCLE();
+    for (int r = 0; r < BENCH_ROUNDS; r++)
+        strcpy((char *) b, (const char *) a);
+    fast = READ_CYCLE() - start;
+    start = READ_CYCLE();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        for (size_t i = 0; (b[i] = a[i]); i++)
+            BARRIER();
+    }
+    slow = READ_CYCLE() - start;
+    printf("strcpy: %d cycles/KB (byte loop: %d)\n",
+           bench_per_kb(fast, size), bench_per_kb(slow, size));
+
+    int diff = 0;
+    start = READ_CYCLE();
+    for (int r = 0; r < BENCH_ROUNDS; r++)
+        diff |= strcmp((const char *) a, (const char *) b);
+    fast = READ_CYCLE() - start;
+    start = READ_CYCLE();
+    for (int r = 0; r < BENCH_ROUNDS; r++) {
+        size_t i = 0;
+        while (a[i] && a[i] == b[i]) {
+            i++;
+            BARRIER();
+        }
+        diff |= a[i] - b[i];
+    }
+    slow = READ_CYCLE() - start;
+    printf("strcmp: %d cycles/KB (byte loop: %d)%s\n", bench_per_kb(fast, size),
+           bench_per_kb(slow, size), diff ? " MISMATCH" : "");
+}
+
+#define PRINTF_BUF_SIZE 128
+
+struct printf_buf { // printf 的输出缓冲区：遇到换行、缓冲区满或者 printf 结束时整体输出
+    char data[PRINTF_BUF_SIZE];
+    size_t len;
+};
+
+void printf_flush(struct printf_buf *pb) {
+    if (pb->len) {
+        console_write(pb->data, pb->len);
+        pb->len = 0;
+    }
+}
+
+void printf_putc(struct printf_buf *pb, char ch) {
+    pb->data[pb->len++] = ch;
+    if (ch == '\n' || pb->len == PRINTF_BUF_SIZE)
+        printf_flush(pb);
+}
 
 void printf(const char *fmt, ...) { // 可变参数列表
+    struct printf_buf pb;
+    pb.len = 0;
     va_list vargs;   // 存放可变参数列表
     va_start(vargs, fmt); // 初始化va_list, 得到参数列表
     while (*fmt) {
@@ -44,15 +240,15 @@ void printf(const char *fmt, ...) { // 可变参数列表
             fmt++;
             switch (*fmt) {
                 case '\0':
-                    putchar('%');
+                    printf_putc(&pb, '%');
                     goto end;
                 case '%':
-                    putchar('%');
+                    printf_putc(&pb, '%');
                     break;
                 case 's': {
                     const char *s = va_arg(vargs, const char *); // 获取参数列表中的下一个参数
                     while (*s) {
-                        putchar(*s);
+                        printf_putc(&pb, *s);
                         s++;
                     }
                     break;
@@ -60,7 +256,7 @@ void printf(const char *fmt, ...) { // 可变参数列表
                 case 'd': {
                     int value = va_arg(vargs, int);
                     if (value < 0) {
-                        putchar('-');
+                        printf_putc(&pb, '-');
                         value = -value;
                     }
 
@@ -69,7 +265,7 @@ void printf(const char *fmt, ...) { // 可变参数列表
                         divisor *= 10;
 
                     while (divisor > 0) {
-                        putchar('0' + value / divisor);
+                        printf_putc(&pb, '0' + value / divisor);
                         value %= divisor;
                         divisor /= 10;
                     }
@@ -80,12 +276,12 @@ void printf(const char *fmt, ...) { // 可变参数列表
                     int value = va_arg(vargs, int);
                     for (int i = 7; i >= 0; i--) {
                         int nibble = (value >> (i * 4)) & 0xf;
-                        putchar("0123456789abcdef"[nibble]);
+                        printf_putc(&pb, "0123456789abcdef"[nibble]);
                     }
                 }
             }
         } else {
-            putchar(*fmt); // 处理普通字符
+            printf_putc(&pb, *fmt); // 处理普通字符
         }
 
         fmt++;
@@ -93,4 +289,5 @@ void printf(const char *fmt, ...) { // 可变参数列表
 
 end:
     va_end(vargs);  // 清理可变参数列表
+    printf_flush(&pb);
 }
@@ -19,15 +19,73 @@ typedef uint32_t vaddr_t;
 #define va_start __builtin_va_start  // 用于初始化参数列表
 #define va_end   __builtin_va_end    // 清理参数列表
 #define va_arg   __builtin_va_arg   // 返回下一个参数
+#define READ_TIME()  ({ uint32_t __t; __asm__ __volatile__("rdtime %0" : "=r"(__t)); __t; })  // time 计数器的低 32 位（10MHz）
+#define READ_CYCLE() ({ uint32_t __c; __asm__ __volatile__("rdcycle %0" : "=r"(__c)); __c; }) // 周期计数器的低 32 位
 #define PAGE_SIZE 4096
 #define SYS_PUTCHAR 1
 #define SYS_GETCHAR 2
 #define SYS_EXIT    3
 #define SYS_READFILE  4
 #define SYS_WRITEFILE 5
+#define SYS_OPEN    6
+#define SYS_READ    7
+#define SYS_WRITE   8
+#define SYS_LSEEK   9
+#define SYS_CLOSE   10
+#define SYS_MMAP    11
+#define SYS_MUNMAP  12
+#define SYS_FORK    13
+#define SYS_EXEC    14
+#define SYS_SLEEP   15
+#define SYS_WAIT    16
+#define SYS_STATS   17
+#define SYS_TRACE   18
+#define SYS_PROFILE 19
+#define SYS_GETPID  20
+#define SYS_YIELD   21
+#define PROT_READ   (1 << 0) // mmap：可读
+#define PROT_WRITE  (1 << 1) // mmap：可写
+#define PROT_EXEC   (1 << 2) // mmap：可执行
+#define MAP_SHARED  (1 << 3) // mmap：写入直接修改文件，munmap 或进程退出时写回磁盘
+#define STDIN_FILENO  0  // 控制台输入
+#define STDOUT_FILENO 1  // 控制台输出
+#define STDERR_FILENO 2  // 控制台输出（与 STDOUT_FILENO 相同）
+#define SEEK_SET 0  // lseek：从文件开头计算偏移
+#define SEEK_CUR 1  // lseek：从当前位置计算偏移
+#define SEEK_END 2  // lseek：从文件末尾计算偏移
+#define PROFILE_START 0 // profile：清空直方图，开始采样
+#define PROFILE_STOP  1 // profile：停止采样
+#define PROFILE_DUMP  2 // profile：停止采样，把直方图导出到文件
+#define STATS_RESET    (1 << 0) // stats：读取之后把内核的计数清零
+#define STATS_SYSCALLS 32       // 按系统调用号统计，号码必须小于它
+#define STATS_BUCKETS  24       // 延迟直方图：第 0 个桶是 [0, 2) 个 tick，第 i 个桶是 [2^i, 2^(i+1)) 个 tick
+
+struct latency_stat { // 一类事件的耗时统计，单位是 time 计数器的 tick（10MHz，0.1 微秒）
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint32_t hist[STATS_BUCKETS];
+    uint64_t total;
+};
+
+struct kernel_stats { // stats 系统调用返回给用户程序的内核计数器
+    struct latency_stat syscalls[STATS_SYSCALLS]; // 按系统调用号统计
+    struct latency_stat interrupts;               // 定时器、IPI 和外部中断
+    struct latency_stat page_faults;              // 用户态缺页
+    uint32_t context_switches;                    // yield 中真正切换到另一个进程的次数
+    uint32_t disk_requests;                       // 提交给 virtio-blk 的请求数
+    uint32_t disk_sectors;                        // 这些请求读写的扇区数
+    uint32_t page_allocs;                         // alloc_pages 的调用次数
+    uint32_t pages_allocated;                     // 分配出去的物理页数（向上取整到 2 的幂之后）
+    uint32_t fork_pages;                          // fork 时父进程的常驻页数之和
+    uint32_t fork_pages_copied;                   // 其中 fork 时立即拷贝的页数（FORK_COPY_ALL 之外应为 0）
+    uint32_t pages_free;                          // 读取时空闲的物理页数（不随 STATS_RESET 清零）
+};
 
 void *memset(void *buf, char c, size_t n);
 void *memcpy(void *dst, const void *src, size_t n);
 char *strcpy(char *dst, const char *src);
 int strcmp(const char *s1, const char *s2);
+void console_write(const char *buf, size_t len); // 输出一段字符，内核和用户程序各自实现
 void printf(const char *fmt, ...);
+void mem_bench(void *buf1, void *buf2, size_t size);
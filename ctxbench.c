@@ -0,0 +1,23 @@
+#include "user.h"
+
+/* 进程切换延迟：父子进程轮流调用 yield，每次 yield 切换到另一个进程。
+ * 只有一个 hart 时两个进程才会真正轮流运行，bench.py 默认用 -smp 1 启动。 */
+#define ROUNDS 2000
+
+void main(void) {
+    uint32_t start = READ_TIME();
+    int pid = fork();
+    if (pid < 0) {
+        printf("ctxbench: fork failed\n");
+        return;
+    }
+
+    for (int i = 0; i < ROUNDS; i++)
+        yield();
+    if (pid == 0)
+        exit();
+
+    wait();
+    uint32_t ticks = READ_TIME() - start;
+    printf("bench: yield_switch %d ns\n", ticks / (2 * ROUNDS / 100)); // 包括 fork 和 exit，均摊到每次切换上很小
+}
@@ -0,0 +1,35 @@
+#include "user.h"
+
+/* 进程创建和回收的压力测试：反复 fork 一个马上退出的子进程并 wait 回收。
+ * 前后比较空闲物理页数，进程的页表、内核栈和用户页都应该被回收，空闲页数保持不变。 */
+#define ROUNDS 1000
+
+struct kernel_stats ks;
+
+int free_pages(void) {
+    if (stats(&ks, 0) < 0)
+        return -1;
+    return ks.pages_free;
+}
+
+void main(void) {
+    int before = free_pages();
+    uint32_t start = READ_TIME();
+    for (int i = 0; i < ROUNDS; i++) {
+        int pid = fork();
+        if (pid < 0) {
+            printf("forkbench: fork failed at round %d\n", i);
+            return;
+        }
+        if (pid == 0)
+            exit();
+        wait();
+    }
+    uint32_t ticks = READ_TIME() - start;
+    int after = free_pages();
+
+    printf("forkbench: %d rounds, free pages %d -> %d%s\n", ROUNDS, before, after,
+           after == before ? "" : " (LEAK)");
+    printf("bench: fork_exit_wait %d ns\n", ticks / (ROUNDS / 100));
+    printf("bench: fork_exit_leak %d pages\n", before - after);
+}
@@ -0,0 +1,75 @@
+#include "user.h"
+
+/* 文件读写吞吐量：用 bench.bin 测试顺序写、顺序读（open/read/write 按块读写，readfile/writefile 整个文件），
+ * 以及按扇区随机读写的延迟。写入在 close 或 writefile 时写回磁盘，计入测量时间。
+ * bench.bin 在磁盘上是空的，先不计时地写满一次：文件变大会让 fs_flush 移动后面所有的文件，那不是顺序写的开销。 */
+#define FILE_SIZE    (64 * 1024)
+#define CHUNK        4096
+#define SECTOR       512
+#define RANDOM_OPS   256
+#define ROUNDS       8
+
+uint8_t buf[FILE_SIZE];
+uint32_t seed = 1;
+
+uint32_t rand(void) { // 线性同余伪随机数，每次运行的访问序列相同
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+void report_rate(const char *name, uint32_t bytes, uint32_t ticks) { // 吞吐量以每 KB 的纳秒数输出，避免 32 位乘法溢出
+    printf("bench: %s %d ns/KB\n", name, ticks * 100 / (bytes / 1024));
+}
+
+void main(void) {
+    for (int i = 0; i < FILE_SIZE; i++)
+        buf[i] = i;
+
+    if (writefile("bench.bin", (const char *) buf, FILE_SIZE) != FILE_SIZE) {
+        printf("fsbench: cannot write bench.bin\n");
+        return;
+    }
+
+    int fd = open("bench.bin");
+
+    uint32_t start = READ_TIME();
+    for (int off = 0; off < FILE_SIZE; off += CHUNK)
+        write(fd, buf + off, CHUNK);
+    close(fd);
+    report_rate("fs_seq_write", FILE_SIZE, READ_TIME() - start);
+
+    start = READ_TIME();
+    fd = open("bench.bin");
+    for (int off = 0; off < FILE_SIZE; off += CHUNK)
+        read(fd, buf + off, CHUNK);
+    close(fd);
+    report_rate("fs_seq_read", FILE_SIZE, READ_TIME() - start);
+
+    start = READ_TIME();
+    fd = open("bench.bin");
+    for (int i = 0; i < RANDOM_OPS; i++) {
+        lseek(fd, rand() % (FILE_SIZE / SECTOR) * SECTOR, SEEK_SET);
+        read(fd, buf, SECTOR);
+    }
+    close(fd);
+    printf("bench: fs_rand_read %d ns\n", (READ_TIME() - start) * 100 / RANDOM_OPS);
+
+    start = READ_TIME();
+    fd = open("bench.bin");
+    for (int i = 0; i < RANDOM_OPS; i++) {
+        lseek(fd, rand() % (FILE_SIZE / SECTOR) * SECTOR, SEEK_SET);
+        write(fd, buf, SECTOR);
+    }
+    close(fd);
+    printf("bench: fs_rand_write %d ns\n", (READ_TIME() - start) * 100 / RANDOM_OPS);
+
+    start = READ_TIME();
+    for (int i = 0; i < ROUNDS; i++)
+        readfile("bench.bin", (char *) buf, FILE_SIZE);
+    report_rate("fs_readfile", ROUNDS * FILE_SIZE, READ_TIME() - start);
+
+    start = READ_TIME();
+    for (int i = 0; i < ROUNDS; i++)
+        writefile("bench.bin", (const char *) buf, FILE_SIZE);
+    report_rate("fs_writefile", ROUNDS * FILE_SIZE, READ_TIME() - start);
+}
@@ -0,0 +1,6 @@
+#include "user.h"
+
+/* 一个最小的用户程序：打包进磁盘镜像，由 shell 通过 exec 加载运行 */
+void main(void) {
+    printf("Hello from hello.elf!\n");
+}
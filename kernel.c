@@ -5,32 +5,265 @@ extern char __kernel_base[];
 extern char __stack_top[];
 extern char __bss[], __bss_end[];
 extern char __free_ram[], __free_ram_end[];
-extern char _binary_shell_bin_start[], _binary_shell_bin_size[];
+extern char _binary_shell_elf_start[], _binary_shell_elf_size[];
 
 struct process procs[PROCS_MAX];
-struct process *current_proc;
-struct process *idle_proc;
+struct cpu cpus[HARTS_MAX];  // 已经启动的 hart，cpus[0] 是启动 hart
+int ncpus;
+struct spinlock kernel_lock; // 大内核锁：任何时刻最多一个 hart 在执行内核代码（空闲的 hart 在 wfi 前释放）
+uint32_t *kernel_page_table; // 内核地址空间的一级页表，所有进程共享其中的一级页表项
+uint32_t asid_max;           // 硬件支持的最大 ASID，0 表示不支持 ASID
+uint32_t asid_generation;    // 当前的 ASID 代数，ASID 用完后加一
+uint32_t asid_next;          // 当前代中下一个可分配的 ASID
+volatile bool profile_running; // 正在剖析：定时器额外按 PROFILE_FREQ 触发，持有大内核锁时也允许定时器中断
+struct kernel_stats kstats;  // 性能计数器，在大内核锁保护下更新，由 stats 系统调用导出
+struct process *boot_shell;  // 还没有被调度过的 shell 进程，第一次切换到它时打印启动耗时
+
+void yield(void);
+void cpu_kick_idle(void);
+void kernel_entry(void);
+void profile_entry(void);
+
+void spinlock_acquire(struct spinlock *lock) {
+    while (__sync_lock_test_and_set(&lock->locked, 1))
+        ;
+    __sync_synchronize();
+}
+
+void spinlock_release(struct spinlock *lock) {
+    __sync_lock_release(&lock->locked);
+}
 
-paddr_t alloc_pages(uint32_t n) {  // 从可用内存起始位置 _free_ram 分配连续 n 个物理页。
-    static paddr_t next_paddr = (paddr_t) __free_ram;
-    paddr_t paddr = next_paddr;
-    next_paddr += n * PAGE_SIZE;
+void profile_kernel_off(void) { // 关闭内核态的采样中断。写 sepc 之前必须调用，否则会被采样中断覆盖
+    __asm__ __volatile__("csrc sstatus, %0" :: "r"(SSTATUS_SIE));
+    WRITE_CSR(stvec, (uint32_t) kernel_entry);
+}
 
-    if (next_paddr > (paddr_t) __free_ram_end)
-        PANIC("out of memory");
+/*
+ * kernel_lock_acquire: 拿到大内核锁。
+ * 剖析时打开内核态的中断，陷入改由 profile_entry 处理，这样内核代码也能被采样。
+ */
+void kernel_lock_acquire(void) {
+    spinlock_acquire(&kernel_lock);
+    if (profile_running) {
+        WRITE_CSR(stvec, (uint32_t) profile_entry);
+        __asm__ __volatile__("csrs sstatus, %0" :: "r"(SSTATUS_SIE));
+    }
+}
+
+void kernel_lock_release(void) { // 返回用户态或者空闲等待之前调用，汇编代码中也会调用
+    profile_kernel_off();
+    spinlock_release(&kernel_lock);
+}
+
+/*
+ * runq_push: 把进程放到当前 hart 的就绪队列尾部，O(1)。
+ * 如果有空闲的 hart，叫醒一个，让它来偷这个进程。
+ */
+void runq_push(struct process *proc) {
+    struct cpu *cpu = this_cpu();
+    proc->run_next = NULL;
+    if (cpu->runq_tail)
+        cpu->runq_tail->run_next = proc;
+    else
+        cpu->runq_head = proc;
+    cpu->runq_tail = proc;
+    cpu->runq_len++;
+    cpu_kick_idle();
+}
+
+struct process *runq_pop(struct cpu *cpu) { // 取出某个 hart 的就绪队列头部的进程，O(1)；队列为空返回 NULL
+    struct process *proc = cpu->runq_head;
+    if (proc) {
+        cpu->runq_head = proc->run_next;
+        if (!cpu->runq_head)
+            cpu->runq_tail = NULL;
+        proc->run_next = NULL;
+        cpu->runq_len--;
+    }
+    return proc;
+}
+
+struct process *runq_steal(struct cpu *self) { // 从就绪队列最长的其他 hart 偷一个进程
+    struct cpu *victim = NULL;
+    for (int i = 0; i < ncpus; i++) {
+        if (&cpus[i] != self && cpus[i].runq_len > 0
+            && (!victim || cpus[i].runq_len > victim->runq_len))
+            victim = &cpus[i];
+    }
+    return victim ? runq_pop(victim) : NULL;
+}
+
+/*
+ * sleep_on: 当前进程在等待队列上睡眠，让出 CPU，直到被 wake_up 唤醒。
+ * 内核态不会被中断打断，其他 hart 也要先拿到大内核锁，所以调用者检查完条件到睡眠之间不会错过唤醒。
+ */
+void sleep_on(struct wait_queue *wq) {
+    current_proc->state = PROC_BLOCKED;
+    current_proc->wait_next = wq->head;
+    wq->head = current_proc;
+    yield();
+}
+
+void wake_up(struct wait_queue *wq) { // 唤醒等待队列上的所有进程，由它们自己重新检查条件
+    while (wq->head) {
+        struct process *proc = wq->head;
+        wq->head = proc->wait_next;
+        proc->wait_next = NULL;
+        proc->state = PROC_RUNNABLE;
+        runq_push(proc);
+    }
+}
+
+bool can_sleep(void) { // 启动阶段和空闲进程中没有可以睡眠的进程，只能忙等
+    return current_proc && current_proc != idle_proc;
+}
+
+void sleeplock_acquire(struct sleeplock *lock) {
+    while (lock->locked && can_sleep())
+        sleep_on(&lock->waiters);
+
+    lock->locked = true;
+}
+
+void sleeplock_release(struct sleeplock *lock) {
+    lock->locked = false;
+    wake_up(&lock->waiters);
+}
+
+struct page *page_descs;                      // 所有可分配物理页的描述符，放在 __free_ram 的开头
+paddr_t page_base;                            // 第一个可分配物理页的地址
+uint32_t page_count;                          // 可分配的物理页总数
+uint32_t free_page_count;                     // 当前空闲的物理页数
+struct page *free_lists[PAGE_ORDER_MAX + 1];  // 伙伴分配器：每一阶一个空闲块链表
+
+void free_list_push(struct page *pg, int order) {
+    pg->order = order;
+    pg->free = true;
+    pg->prev = NULL;
+    pg->next = free_lists[order];
+    if (pg->next)
+        pg->next->prev = pg;
+    free_lists[order] = pg;
+}
+
+void free_list_remove(struct page *pg) {
+    if (pg->prev)
+        pg->prev->next = pg->next;
+    else
+        free_lists[pg->order] = pg->next;
+
+    if (pg->next)
+        pg->next->prev = pg->prev;
+
+    pg->free = false;
+}
+
+/*
+ * page_init: 初始化伙伴分配器。
+ * 页描述符数组占用 __free_ram 开头的若干页，剩下的内存按对齐的最大块挂到各阶空闲链表上。
+ */
+void page_init(void) {
+    uint32_t total = ((paddr_t) __free_ram_end - (paddr_t) __free_ram) / PAGE_SIZE;
+    size_t descs_size = align_up(sizeof(struct page) * total, PAGE_SIZE);
+    page_descs = (struct page *) __free_ram;
+    page_base = (paddr_t) __free_ram + descs_size;
+    page_count = ((paddr_t) __free_ram_end - page_base) / PAGE_SIZE;
+    memset(page_descs, 0, descs_size);
+
+    uint32_t i = 0;
+    while (i < page_count) {
+        int order = PAGE_ORDER_MAX;
+        while ((i & ((1u << order) - 1)) != 0 || i + (1u << order) > page_count)
+            order--;
+
+        free_list_push(&page_descs[i], order);
+        free_page_count += 1u << order;
+        i += 1u << order;
+    }
 
+    printf("memory: %d pages free\n", free_page_count);
+}
+
+paddr_t alloc_pages(uint32_t n) {  // 分配连续 n 个物理页（向上取整到 2 的幂），并清零。内存不足时返回 0，由调用者让操作失败
+    int order = 0;
+    while ((1u << order) < n)
+        order++;
+
+    int avail = order;  // 找到能满足需求的最小的非空阶
+    while (avail <= PAGE_ORDER_MAX && !free_lists[avail])
+        avail++;
+
+    if (avail > PAGE_ORDER_MAX)
+        return 0;
+
+    struct page *pg = free_lists[avail];
+    free_list_remove(pg);
+    while (avail > order) {  // 块太大，就对半拆分，后一半挂回低一阶的空闲链表
+        avail--;
+        free_list_push(pg + (1u << avail), avail);
+    }
+
+    pg->order = order;
+    pg->refs = 1;
+    free_page_count -= 1u << order;
+    kstats.page_allocs++;
+    kstats.pages_allocated += 1u << order;
+
+    paddr_t paddr = page_base + (pg - page_descs) * PAGE_SIZE;
     memset((void *) paddr, 0, n * PAGE_SIZE);
     return paddr;
 }
 
+void free_pages(paddr_t paddr, uint32_t n) {  // 释放 alloc_pages 分配的页，并与空闲的伙伴块合并。
+    if (paddr < page_base || !is_aligned(paddr, PAGE_SIZE))
+        PANIC("free_pages: invalid paddr %x", paddr);
+
+    uint32_t idx = (paddr - page_base) / PAGE_SIZE;
+    if (idx >= page_count || page_descs[idx].free)
+        PANIC("free_pages: double free or invalid paddr %x", paddr);
+
+    int order = page_descs[idx].order;
+    if ((1u << order) < n)
+        PANIC("free_pages: size mismatch paddr=%x n=%d", paddr, n);
+
+    free_page_count += 1u << order;
+    while (order < PAGE_ORDER_MAX) {
+        uint32_t buddy = idx ^ (1u << order);
+        if (buddy >= page_count || !page_descs[buddy].free
+            || page_descs[buddy].order != order)
+            break;
+
+        free_list_remove(&page_descs[buddy]);
+        idx &= ~(1u << order);
+        order++;
+    }
+
+    free_list_push(&page_descs[idx], order);
+}
+
+struct page *page_desc(paddr_t paddr) { // 取得 alloc_pages 分配的物理页的描述符
+    return &page_descs[(paddr - page_base) / PAGE_SIZE];
+}
+
+void page_get(paddr_t paddr) { // 多一个进程共享该页
+    page_desc(paddr)->refs++;
+}
+
+void page_put(paddr_t paddr) { // 少一个进程共享该页，没有进程再使用时释放
+    if (--page_desc(paddr)->refs == 0)
+        free_pages(paddr, 1);
+}
+
 /*
  * map_page: 用于在页表中映射虚拟地址到物理地址。
  * table1 指向一级页表的指针
  * vaddr 要映射的虚拟地址
  * paddr 对应的物理地址
  * flags 读写权限标志
+ * 需要新的二级页表而内存不足时返回 false，什么都不映射。
  */
-void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
+bool map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
     if (!is_aligned(vaddr, PAGE_SIZE))   // 检查虚拟地址是否对齐
         PANIC("unaligned vaddr %x", vaddr);
 
@@ -40,12 +273,144 @@ void map_page(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
     uint32_t vpn1 = (vaddr >> 22) & 0x3ff;  // 从虚拟地址高位得到 VPN1（一级虚拟页号）
     if ((table1[vpn1] & PAGE_V) == 0) {     // 检查一级页表中能否找到有效的二级页表
         uint32_t pt_paddr = alloc_pages(1); // 找不到，那么分配一页作为二级页表。
+        if (!pt_paddr)
+            return false;
         table1[vpn1] = ((pt_paddr / PAGE_SIZE) << 10) | PAGE_V; // 更新一级页表 VPN1，记录二级页表的地址
     }
 
     uint32_t vpn0 = (vaddr >> 12) & 0x3ff;  // 从虚拟地址找到 VPN0（二级虚拟页号）
     uint32_t *table0 = (uint32_t *) ((table1[vpn1] >> 10) * PAGE_SIZE); // 从一级页表中得到二级页表的地址
     table0[vpn0] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;        // 将物理地址赋值给二级页表的虚拟页号。
+    return true;
+}
+
+uint32_t *lookup_pte(uint32_t *table1, vaddr_t vaddr) { // 查找 vaddr 对应的二级页表项，没有二级页表时返回 NULL
+    uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+    if ((table1[vpn1] & PAGE_V) == 0 || (table1[vpn1] & (PAGE_R | PAGE_W | PAGE_X)))
+        return NULL; // 没有二级页表，或者是大页
+
+    uint32_t *table0 = (uint32_t *) ((table1[vpn1] >> 10) * PAGE_SIZE);
+    return &table0[(vaddr >> 12) & 0x3ff];
+}
+
+/*
+ * map_megapage: 在一级页表中直接映射一个 4MB 的大页，不需要二级页表。
+ */
+void map_megapage(uint32_t *table1, uint32_t vaddr, paddr_t paddr, uint32_t flags) {
+    if (!is_aligned(vaddr, MEGAPAGE_SIZE) || !is_aligned(paddr, MEGAPAGE_SIZE))
+        PANIC("unaligned megapage vaddr=%x paddr=%x", vaddr, paddr);
+
+    uint32_t vpn1 = (vaddr >> 22) & 0x3ff;
+    table1[vpn1] = ((paddr / PAGE_SIZE) << 10) | flags | PAGE_V;
+}
+
+/*
+ * kernel_vm_init: 只构建一次内核地址空间（恒等映射）。
+ * 4MB 对齐的部分用大页映射，首尾不对齐的部分用 4KB 页映射。
+ * 之后每个进程的页表直接复制这里的一级页表项，共享同一批二级页表。
+ */
+void kernel_vm_init(void) {
+    kernel_page_table = (uint32_t *) alloc_pages(1); // 启动时内存充足，这里及下面的映射不会失败
+
+    paddr_t paddr = (paddr_t) __kernel_base;
+    while (paddr < (paddr_t) __free_ram_end) {
+        if (is_aligned(paddr, MEGAPAGE_SIZE)
+            && paddr + MEGAPAGE_SIZE <= (paddr_t) __free_ram_end) {
+            map_megapage(kernel_page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X | PAGE_G);
+            paddr += MEGAPAGE_SIZE;
+        } else {
+            map_page(kernel_page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X | PAGE_G);
+            paddr += PAGE_SIZE;
+        }
+    }
+
+    // 串口（只用来接收输入）
+    map_page(kernel_page_table, UART_PADDR, UART_PADDR, PAGE_R | PAGE_W | PAGE_G);
+
+    // virtio-blk  虚拟块设备的映射
+    map_page(kernel_page_table, VIRTIO_BLK_PADDR, VIRTIO_BLK_PADDR, PAGE_R | PAGE_W | PAGE_G);
+
+    // PLIC 的优先级、使能和领取寄存器都在开头 4MB 内，用一个大页映射
+    map_megapage(kernel_page_table, PLIC_PADDR, PLIC_PADDR, PAGE_R | PAGE_W | PAGE_G);
+}
+
+bool is_kernel_pte(uint32_t *table1, int vpn1) { // 该一级页表项是否是从内核页表共享来的
+    return table1[vpn1] != 0 && table1[vpn1] == kernel_page_table[vpn1];
+}
+
+/*
+ * free_user_pages: 释放页表中映射的用户页面和二级页表，只保留与内核共享的一级页表项。
+ * 与内核共享的一级页表项（内核页面和设备页面）和带 PAGE_NOFREE 的页不属于该进程，跳过。
+ */
+void free_user_pages(uint32_t *table1) {
+    for (int vpn1 = 0; vpn1 < 1024; vpn1++) {
+        if ((table1[vpn1] & PAGE_V) == 0 || is_kernel_pte(table1, vpn1))
+            continue;
+
+        uint32_t *table0 = (uint32_t *) ((table1[vpn1] >> 10) * PAGE_SIZE);
+        for (int vpn0 = 0; vpn0 < 1024; vpn0++) {
+            uint32_t pte = table0[vpn0];
+            if ((pte & PAGE_V) && (pte & PAGE_U) && !(pte & PAGE_NOFREE))
+                page_put((pte >> 10) * PAGE_SIZE);
+        }
+
+        free_pages((paddr_t) table0, 1);
+        table1[vpn1] = 0;
+    }
+}
+
+void free_page_table(uint32_t *table1) { // 释放进程的页表，以及页表中映射的用户页面
+    free_user_pages(table1);
+    free_pages((paddr_t) table1, 1);
+}
+
+/*
+ * asid_init: 探测硬件支持的 ASID 位数。
+ * 向 satp 的 ASID 字段写入全 1，读回来的值就是硬件实际保留的位。
+ */
+void asid_init(void) {
+    uint32_t satp = SATP_SV32 | ((uint32_t) kernel_page_table / PAGE_SIZE);
+    WRITE_CSR(satp, satp | (SATP_ASID_MASK << SATP_ASID_SHIFT));
+    asid_max = (READ_CSR(satp) >> SATP_ASID_SHIFT) & SATP_ASID_MASK;
+    WRITE_CSR(satp, 0);
+    __asm__ __volatile__("sfence.vma");
+
+    asid_generation = 1;
+    asid_next = 1; // ASID 0 保留给不支持 ASID 的情况
+    printf("asid: max=%d\n", asid_max);
+}
+
+#define ASID_FLUSH_NONE 0
+#define ASID_FLUSH_ONE  1  // 只需要刷新该 ASID 的 TLB 表项
+#define ASID_FLUSH_ALL  2  // 需要刷新整个 TLB
+
+/*
+ * asid_assign: 确保进程持有当前代的 ASID，返回切换到该进程后需要的 TLB 刷新范围。
+ * ASID 用完时进入新的一代，之前分配的 ASID 全部作废，刷新一次整个 TLB。
+ */
+int asid_assign(struct process *proc) {
+    if (asid_max == 0) {
+        proc->asid = 0;
+        return ASID_FLUSH_ALL;
+    }
+
+    if (proc->asid_generation == asid_generation)
+        return ASID_FLUSH_NONE;
+
+    int flush = ASID_FLUSH_ONE;
+    if (asid_next > asid_max) {
+        asid_generation++;
+        asid_next = 1;
+        flush = ASID_FLUSH_ALL;
+    }
+
+    proc->asid = asid_next++;
+    proc->asid_generation = asid_generation;
+    return flush;
+}
+
+void flush_tlb_page(uint32_t asid, vaddr_t vaddr) { // 只刷新某个地址空间中一个页的 TLB 表项
+    __asm__ __volatile__("sfence.vma %0, %1" :: "r"(vaddr), "r"(asid) : "memory");
 }
 
 struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4,
@@ -67,10 +432,50 @@ struct sbiret sbi_call(long arg0, long arg1, long arg2, long arg3, long arg4,
     return (struct sbiret){.error = a0, .value = a1};
 }
 
+void cpu_kick_idle(void) { // 如果有其他 hart 正在 wfi，发 IPI 叫醒一个，让它来偷新的就绪进程
+    for (int i = 0; i < ncpus; i++) {
+        struct cpu *cpu = &cpus[i];
+        if (cpu != this_cpu() && cpu->waiting) {
+            cpu->waiting = false;
+            sbi_call(1, cpu->hartid, 0, 0, 0, 0, 0 /* send_ipi */, SBI_EXT_IPI);
+            return;
+        }
+    }
+}
+
+uint64_t read_time(void) { // 读取 64 位的 time 计数器（RV32 上需要分两次读取）
+    uint32_t hi, lo;
+    do {
+        hi = READ_CSR(timeh);
+        lo = READ_CSR(time);
+    } while (hi != READ_CSR(timeh)); // 读取期间低位溢出，重新读
+    return ((uint64_t) hi << 32) | lo;
+}
+
+/*
+ * trace: 往本 hart 的跟踪环形缓冲区追加一条记录，不加锁。
+ * 内核态不会被中断打断，每个环只有一个写者；先写记录再增加 head，导出时据此判断哪些记录完整。
+ */
+void trace(uint32_t event, uint32_t arg0, uint32_t arg1) {
+    struct cpu *cpu = this_cpu();
+    struct trace_ring *ring = &cpu->trace;
+    struct trace_record *rec = &ring->records[ring->head % TRACE_ENTRIES];
+    rec->time = read_time();
+    rec->event = event;
+    rec->hart = cpu->hartid;
+    rec->pid = cpu->current ? cpu->current->pid : 0;
+    rec->arg0 = arg0;
+    rec->arg1 = arg1;
+    __sync_synchronize();
+    ring->head++;
+}
+
 struct virtio_virtq *blk_request_vq;
-struct virtio_blk_req *blk_req;
-paddr_t blk_req_paddr;
+struct virtio_blk_req *blk_reqs;                // 请求缓冲区池，设备通过 DMA 访问
+struct blk_slot blk_slots[BLK_REQ_MAX];
+uint8_t blk_desc_slot[VIRTQ_ENTRY_NUM];         // 描述符链头 -> 请求槽位
 unsigned blk_capacity;
+struct wait_queue blk_wait;   // 等待请求完成或空闲槽位的进程
 
 uint32_t virtio_reg_read32(unsigned offset) {
     return *((volatile uint32_t *) (VIRTIO_BLK_PADDR + offset));
@@ -88,23 +493,47 @@ void virtio_reg_fetch_and_or32(unsigned offset, uint32_t value) {
     virtio_reg_write32(offset, virtio_reg_read32(offset) | value);
 }
 
-bool virtq_is_busy(struct virtio_virtq *vq) {
-    return vq->last_used_index != *vq->used_index;
-}
-
-void virtq_kick(struct virtio_virtq *vq, int desc_index) {
+void virtq_kick(struct virtio_virtq *vq, int desc_index) { // 把描述符链放入 avail ring，并通知设备
     vq->avail.ring[vq->avail.index % VIRTQ_ENTRY_NUM] = desc_index;
+    __sync_synchronize();
     vq->avail.index++;
     __sync_synchronize();
     virtio_reg_write32(VIRTIO_REG_QUEUE_NOTIFY, vq->queue_index);
-    vq->last_used_index++;
+}
+
+int virtq_alloc_desc(struct virtio_virtq *vq) { // 从空闲链表取一个描述符，没有则返回 -1
+    if (vq->num_free == 0)
+        return -1;
+
+    int index = vq->free_head;
+    vq->free_head = vq->descs[index].next;
+    vq->num_free--;
+    return index;
+}
+
+void virtq_free_chain(struct virtio_virtq *vq, int head) { // 把整条描述符链放回空闲链表
+    int index = head;
+    while (1) {
+        uint16_t flags = vq->descs[index].flags;
+        uint16_t next = vq->descs[index].next;
+        vq->descs[index].next = vq->free_head;
+        vq->free_head = index;
+        vq->num_free++;
+        if (!(flags & VIRTQ_DESC_F_NEXT))
+            break;
+        index = next;
+    }
 }
 
 struct virtio_virtq *virtq_init(unsigned index) {
-    paddr_t virtq_paddr = alloc_pages(align_up(sizeof(struct virtio_virtq), PAGE_SIZE) / PAGE_SIZE);
+    paddr_t virtq_paddr = alloc_pages(align_up(sizeof(struct virtio_virtq), PAGE_SIZE) / PAGE_SIZE); // 启动时调用，不会失败
     struct virtio_virtq *vq = (struct virtio_virtq *) virtq_paddr;
     vq->queue_index = index;
     vq->used_index = (volatile uint16_t *) &vq->used.index;
+    for (int i = 0; i < VIRTQ_ENTRY_NUM; i++)
+        vq->descs[i].next = i + 1;
+    vq->free_head = 0;
+    vq->num_free = VIRTQ_ENTRY_NUM;
     virtio_reg_write32(VIRTIO_REG_QUEUE_SEL, index);
     virtio_reg_write32(VIRTIO_REG_QUEUE_NUM, VIRTQ_ENTRY_NUM);
     virtio_reg_write32(VIRTIO_REG_QUEUE_ALIGN, 0);
@@ -130,54 +559,311 @@ void virtio_blk_init(void) {
     blk_capacity = virtio_reg_read64(VIRTIO_REG_DEVICE_CONFIG + 0) * SECTOR_SIZE;
     printf("virtio-blk: capacity is %d bytes\n", blk_capacity);
 
-    blk_req_paddr = alloc_pages(align_up(sizeof(*blk_req), PAGE_SIZE) / PAGE_SIZE);
-    blk_req = (struct virtio_blk_req *) blk_req_paddr;
+    blk_reqs = (struct virtio_blk_req *) alloc_pages(
+        align_up(sizeof(*blk_reqs) * BLK_REQ_MAX, PAGE_SIZE) / PAGE_SIZE);
+}
+
+/*
+ * blk_reap: 遍历 used ring，回收设备已经完成的请求。
+ * 释放描述符和请求槽位，更新所属批次的计数。
+ */
+void blk_reap(void) {
+    struct virtio_virtq *vq = blk_request_vq;
+    while (vq->last_used_index != *vq->used_index) {
+        __sync_synchronize();
+        int head = vq->used.ring[vq->last_used_index % VIRTQ_ENTRY_NUM].id;
+        vq->last_used_index++;
+
+        int i = blk_desc_slot[head];
+        struct blk_slot *slot = &blk_slots[i];
+        struct virtio_blk_req *req = &blk_reqs[i];
+        trace(TRACE_BLK_DONE, i, req->status);
+        if (req->status != 0) {
+            printf("virtio: warn: failed to read/write sector=%d status=%d\n",
+                   (unsigned) req->sector, req->status);
+            slot->batch->errors++;
+        }
+
+        slot->batch->pending--;
+        slot->in_use = false;
+        virtq_free_chain(vq, head);
+    }
+}
+
+void blk_wait_event(void) { // 等待有请求完成：能睡眠就睡眠等完成中断，否则（启动阶段）轮询
+    if (can_sleep())
+        sleep_on(&blk_wait);
+    else
+        blk_reap();
 }
 
-void read_write_disk(void *buf, unsigned sector, int is_write) {
-    if (sector >= blk_capacity / SECTOR_SIZE) {
+/*
+ * blk_submit_req: 提交一个请求后立即返回，不等待完成。
+ * 零拷贝：描述符直接指向物理地址 data。
+ * 所有槽位都在使用中时，等待有请求完成再提交。
+ */
+void blk_submit_req(struct blk_batch *batch, paddr_t data,
+                    unsigned sector, unsigned count, int is_write) {
+    if (sector + count > blk_capacity / SECTOR_SIZE) {
         printf("virtio: tried to read/write sector=%d, but capacity is %d\n",
-              sector, blk_capacity / SECTOR_SIZE);
+              sector + count - 1, blk_capacity / SECTOR_SIZE);
+        batch->errors++;
         return;
     }
 
-    blk_req->sector = sector;
-    blk_req->type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    int i;
+    while (1) {
+        for (i = 0; i < BLK_REQ_MAX; i++) {
+            if (!blk_slots[i].in_use)
+                break;
+        }
+
+        if (i < BLK_REQ_MAX)
+            break;
 
-    if (is_write)
-        memcpy(blk_req->data, buf, SECTOR_SIZE);
+        blk_wait_event();
+    }
 
+    struct blk_slot *slot = &blk_slots[i];
+    slot->in_use = true;
+    slot->is_write = is_write;
+    slot->batch = batch;
+    batch->pending++;
+    kstats.disk_requests++;
+    kstats.disk_sectors += count;
+    trace(TRACE_BLK_KICK, i | (count << 8) | ((uint32_t) !!is_write << 31), sector);
+
+    struct virtio_blk_req *req = &blk_reqs[i];
+    req->sector = sector;
+    req->type = is_write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    req->status = 0xff;
+
+    // 每个槽位最多占 3 个描述符，有空闲槽位就一定有足够的描述符。
     struct virtio_virtq *vq = blk_request_vq;
-    vq->descs[0].addr = blk_req_paddr;
-    vq->descs[0].len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
-    vq->descs[0].flags = VIRTQ_DESC_F_NEXT;
-    vq->descs[0].next = 1;
-
-    vq->descs[1].addr = blk_req_paddr + offsetof(struct virtio_blk_req, data);
-    vq->descs[1].len = SECTOR_SIZE;
-    vq->descs[1].flags = VIRTQ_DESC_F_NEXT | (is_write ? 0 : VIRTQ_DESC_F_WRITE);
-    vq->descs[1].next = 2;
-
-    vq->descs[2].addr = blk_req_paddr + offsetof(struct virtio_blk_req, status);
-    vq->descs[2].len = sizeof(uint8_t);
-    vq->descs[2].flags = VIRTQ_DESC_F_WRITE;
-
-    virtq_kick(vq, 0);
-    while (virtq_is_busy(vq))
-        ;
+    int d0 = virtq_alloc_desc(vq);
+    int d1 = virtq_alloc_desc(vq);
+    int d2 = virtq_alloc_desc(vq);
+    blk_desc_slot[d0] = i;
+
+    paddr_t req_paddr = (paddr_t) req;
+    vq->descs[d0].addr = req_paddr;
+    vq->descs[d0].len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
+    vq->descs[d0].flags = VIRTQ_DESC_F_NEXT;
+    vq->descs[d0].next = d1;
+
+    vq->descs[d1].addr = data;
+    vq->descs[d1].len = count * SECTOR_SIZE;
+    vq->descs[d1].flags = VIRTQ_DESC_F_NEXT | (is_write ? 0 : VIRTQ_DESC_F_WRITE);
+    vq->descs[d1].next = d2;
+
+    vq->descs[d2].addr = req_paddr + offsetof(struct virtio_blk_req, status);
+    vq->descs[d2].len = sizeof(uint8_t);
+    vq->descs[d2].flags = VIRTQ_DESC_F_WRITE;
+
+    virtq_kick(vq, d0);
+}
 
-    if (blk_req->status != 0) {
-        printf("virtio: warn: failed to read/write sector=%d status=%d\n",
-               sector, blk_req->status);
-        return;
+/*
+ * blk_submit_pages: 零拷贝读写连续的多个扇区。
+ * 描述符直接指向物理地址 buf，设备通过 DMA 读写调用者的内存，不经过中转缓冲区。
+ * 超过 BLK_SECTORS_MAX 的范围拆成多个请求同时提交。
+ */
+void blk_submit_pages(struct blk_batch *batch, paddr_t buf, unsigned sector,
+                      unsigned count, int is_write) {
+    while (count > 0) {
+        unsigned n = count < BLK_SECTORS_MAX ? count : BLK_SECTORS_MAX;
+        blk_submit_req(batch, buf, sector, n, is_write);
+        buf += n * SECTOR_SIZE;
+        sector += n;
+        count -= n;
+    }
+}
+
+void blk_batch_wait(struct blk_batch *batch) { // 等待一批请求全部完成
+    while (batch->pending > 0)
+        blk_wait_event();
+}
+
+void virtio_blk_handle_irq(void) { // virtio-blk 完成中断：确认中断，回收完成的请求，唤醒等待的进程
+    virtio_reg_write32(VIRTIO_REG_INTERRUPT_ACK,
+                       virtio_reg_read32(VIRTIO_REG_INTERRUPT_STATUS));
+    blk_reap();
+    wake_up(&blk_wait);
+}
+
+struct buf bcache[BCACHE_NUM];
+struct buf *bcache_hash[BCACHE_HASH_SIZE];  // 扇区号 -> 缓冲区
+struct buf *bcache_lru_head;
+struct buf *bcache_lru_tail;
+struct wait_queue bcache_wait;              // 等待缓冲区空闲的进程
+unsigned bcache_hits;
+unsigned bcache_misses;
+
+void bcache_init(void) {
+    for (int i = 0; i < BCACHE_NUM; i++) {
+        struct buf *b = &bcache[i];
+        b->lru_prev = bcache_lru_tail;
+        if (bcache_lru_tail)
+            bcache_lru_tail->lru_next = b;
+        else
+            bcache_lru_head = b;
+        bcache_lru_tail = b;
+    }
+}
+
+void bcache_lru_remove(struct buf *b) {
+    if (b->lru_prev)
+        b->lru_prev->lru_next = b->lru_next;
+    else
+        bcache_lru_head = b->lru_next;
+
+    if (b->lru_next)
+        b->lru_next->lru_prev = b->lru_prev;
+    else
+        bcache_lru_tail = b->lru_prev;
+}
+
+void bcache_lru_touch(struct buf *b) { // 移到 LRU 表头（最近使用）
+    bcache_lru_remove(b);
+    b->lru_prev = NULL;
+    b->lru_next = bcache_lru_head;
+    if (bcache_lru_head)
+        bcache_lru_head->lru_prev = b;
+    else
+        bcache_lru_tail = b;
+    bcache_lru_head = b;
+}
+
+void bcache_hash_remove(struct buf *b) {
+    struct buf **p = &bcache_hash[b->sector % BCACHE_HASH_SIZE];
+    while (*p && *p != b)
+        p = &(*p)->hash_next;
+    if (*p)
+        *p = b->hash_next;
+}
+
+struct buf *bcache_lookup(unsigned sector) {
+    struct buf *b = bcache_hash[sector % BCACHE_HASH_SIZE];
+    while (b && b->sector != sector)
+        b = b->hash_next;
+    return b;
+}
+
+void bcache_wait_event(void) { // 等待其他进程释放缓冲区
+    if (!can_sleep())
+        PANIC("bcache: all buffers are busy");
+    sleep_on(&bcache_wait);
+}
+
+void brelse(struct buf *b) { // 释放 bget/bread 占用的缓冲区
+    b->busy = false;
+    bcache_lru_touch(b);
+    wake_up(&bcache_wait);
+}
+
+void bwrite_back(struct buf *b) { // 同步写回一个脏缓冲区（调用者已占用它）
+    struct blk_batch batch = {0};
+    blk_submit_pages(&batch, (paddr_t) b->data, b->sector, 1, true);
+    blk_batch_wait(&batch);
+    b->dirty = false;
+}
+
+/*
+ * bget: 占用扇区 sector 对应的缓冲区，内容不一定有效（valid 为 false 时需要读盘或整体覆盖）。
+ * 没有缓存时从 LRU 表尾淘汰一个空闲的缓冲区，脏缓冲区先写回。
+ */
+struct buf *bget(unsigned sector) {
+    while (1) {
+        struct buf *b = bcache_lookup(sector);
+        if (b) {
+            if (b->busy) {
+                bcache_wait_event();
+                continue;
+            }
+
+            bcache_hits++;
+            b->busy = true;
+            return b;
+        }
+
+        struct buf *victim = bcache_lru_tail;
+        while (victim && victim->busy)
+            victim = victim->lru_prev;
+
+        if (!victim) {
+            bcache_wait_event();
+            continue;
+        }
+
+        if (victim->dirty) { // 写回时会睡眠，其他进程可能已经缓存了该扇区，写完重新查找
+            victim->busy = true;
+            bwrite_back(victim);
+            victim->busy = false;
+            wake_up(&bcache_wait);
+            continue;
+        }
+
+        bcache_misses++;
+        if (victim->hashed) // 读盘失败的缓冲区 valid 为 false，但仍在哈希表中
+            bcache_hash_remove(victim);
+        victim->sector = sector;
+        victim->valid = false;
+        victim->busy = true;
+        victim->hashed = true;
+        victim->hash_next = bcache_hash[sector % BCACHE_HASH_SIZE];
+        bcache_hash[sector % BCACHE_HASH_SIZE] = victim;
+        return victim;
+    }
+}
+
+struct buf *bread(unsigned sector) { // 占用并返回内容有效的缓冲区，没有缓存时直接 DMA 到缓冲区
+    struct buf *b = bget(sector);
+    if (!b->valid) {
+        struct blk_batch batch = {0};
+        blk_submit_pages(&batch, (paddr_t) b->data, sector, 1, false);
+        blk_batch_wait(&batch);
+        b->valid = batch.errors == 0;
+    }
+    return b;
+}
+
+void bdirty(struct buf *b) { // 标记缓冲区已修改，在 bsync 或被淘汰时写回
+    b->valid = true;
+    b->dirty = true;
+}
+
+/*
+ * bsync: 把所有空闲的脏缓冲区作为一批请求写回磁盘，返回写回的扇区数。
+ * 有请求失败时返回 -1，这一批缓冲区都保持为脏，下次再写（重写成功的扇区没有副作用）。
+ */
+int bsync(void) {
+    struct buf *bufs[BCACHE_NUM];
+    int n = 0;
+    struct blk_batch batch = {0};
+    for (int i = 0; i < BCACHE_NUM; i++) {
+        struct buf *b = &bcache[i];
+        if (!b->dirty || b->busy)
+            continue;
+
+        b->busy = true;
+        blk_submit_pages(&batch, (paddr_t) b->data, b->sector, 1, true);
+        bufs[n++] = b;
     }
 
-    if (!is_write)
-        memcpy(buf, blk_req->data, SECTOR_SIZE);
+    blk_batch_wait(&batch);
+    for (int i = 0; i < n; i++) {
+        bufs[i]->dirty = batch.errors != 0;
+        brelse(bufs[i]);
+    }
+    return batch.errors ? -1 : n;
 }
 
-struct file files[FILES_MAX];
-uint8_t disk[DISK_MAX_SIZE];
+struct file files[FILES_MAX];          // 按在归档中的顺序排列
+int files_count;                        // 已使用的文件数，files[0..files_count) 都在使用中
+struct file *file_hash[FILE_HASH_SIZE]; // 文件名 -> 文件
+struct file *fs_dirty_head;             // 有修改、等待 fs_flush 写回的文件
+struct sleeplock fs_lock; // fs_flush 写盘时会睡眠，防止其他进程同时改写同一批扇区
+unsigned fs_end_sector;   // 归档中最后一个文件之后的扇区
 
 int oct2int(char *oct, int len) {
     int dec = 0;
@@ -190,94 +876,599 @@ int oct2int(char *oct, int len) {
     return dec;
 }
 
-void fs_flush(void) {
-    memset(disk, 0, sizeof(disk));
-    unsigned off = 0;
-    for (int file_i = 0; file_i < FILES_MAX; file_i++) {
-        struct file *file = &files[file_i];
-        if (!file->in_use)
-            continue;
-
-        struct tar_header *header = (struct tar_header *) &disk[off];
-        memset(header, 0, sizeof(*header));
-        strcpy(header->name, file->name);
-        strcpy(header->mode, "000644");
-        strcpy(header->magic, "ustar");
-        strcpy(header->version, "00");
-        header->type = '0';
+void fs_write_data(unsigned sector, const void *src, size_t size) { // 把数据写进从 sector 开始的扇区缓冲区，不足一个扇区的部分补零
+    for (size_t off = 0; off < size; off += SECTOR_SIZE, sector++) {
+        struct buf *b = bget(sector);
+        size_t n = size - off < SECTOR_SIZE ? size - off : SECTOR_SIZE;
+        memset(b->data, 0, SECTOR_SIZE);
+        memcpy(b->data, (const uint8_t *) src + off, n);
+        bdirty(b);
+        brelse(b);
+    }
+}
 
-        int filesz = file->size;
-        for (int i = sizeof(header->size); i > 0; i--) {
-            header->size[i - 1] = (filesz % 8) + '0';
-            filesz /= 8;
-        }
+uint32_t fs_hash(const char *name) { // FNV-1a 字符串哈希
+    uint32_t h = 2166136261u;
+    while (*name)
+        h = (h ^ (uint8_t) *name++) * 16777619u;
+    return h & (FILE_HASH_SIZE - 1);
+}
 
-        int checksum = ' ' * sizeof(header->checksum);
-        for (unsigned i = 0; i < sizeof(struct tar_header); i++)
-            checksum += (unsigned char) disk[off + i];
+/*
+ * fs_reserve: 确保文件数据的容量至少为 size 字节。
+ * 容量不够时分配一块新的物理页并把原来的内容拷过去，返回 false 表示超过了最大文件大小或者内存不足。
+ */
+bool fs_reserve(struct file *file, size_t size) {
+    if (size > FILE_SIZE_MAX)
+        return false;
+    if (size <= file->capacity)
+        return true;
+    if (file->map_count > 0) // 物理页已经映射到进程中，不能换成新的页
+        return false;
+
+    size_t npages = align_up(size, PAGE_SIZE) / PAGE_SIZE;
+    uint8_t *data = (uint8_t *) alloc_pages(npages);
+    if (!data)
+        return false;
+    if (file->data) {
+        memcpy(data, file->data, file->size);
+        free_pages((paddr_t) file->data, file->capacity / PAGE_SIZE);
+    }
 
-        for (int i = 5; i >= 0; i--) {
-            header->checksum[i] = (checksum % 8) + '0';
-            checksum /= 8;
-        }
+    file->data = data;
+    file->capacity = npages * PAGE_SIZE;
+    return true;
+}
 
-        memcpy(header->data, file->data, file->size);
-        off += align_up(sizeof(struct tar_header) + file->size, SECTOR_SIZE);
+/*
+ * fs_load: 第一次访问文件内容时读入数据扇区。调用者需要持有 fs_lock。
+ * 块缓存中有的扇区（可能还没写回）从缓存拷贝，其余连续的扇区直接 DMA 到新分配的页中，
+ * 大文件不经过缓存，也不会把缓存中的其他扇区挤出去。
+ * 文件超过 FILE_SIZE_MAX（归档中允许存在）或者内存不够时返回 false，调用者让系统调用失败。
+ */
+bool fs_load(struct file *file) {
+    if (file->loaded)
+        return true;
+
+    trace(TRACE_FS_ENTER, TRACE_FS_LOAD, file - files);
+    if (!fs_reserve(file, file->size)) {
+        trace(TRACE_FS_EXIT, TRACE_FS_LOAD, -1);
+        return false;
     }
 
-    for (unsigned sector = 0; sector < sizeof(disk) / SECTOR_SIZE; sector++)
-        read_write_disk(&disk[sector * SECTOR_SIZE], sector, true);
+    struct blk_batch batch = {0};
+    unsigned run = 0; // 还没提交的连续未缓存扇区的起点
+    for (unsigned i = 0; i <= file->nsectors; i++) {
+        struct buf *b = i < file->nsectors ? bcache_lookup(file->sector + 1 + i) : NULL;
+        if (i < file->nsectors && !(b && b->valid))
+            continue;
 
-    printf("wrote %d bytes to disk\n", sizeof(disk));
+        if (i > run)
+            blk_submit_pages(&batch, (paddr_t) file->data + run * SECTOR_SIZE, file->sector + 1 + run, i - run, false);
+        if (b)
+            memcpy(file->data + i * SECTOR_SIZE, b->data, SECTOR_SIZE);
+        run = i + 1;
+    }
+    blk_batch_wait(&batch);
+    file->loaded = true;
+    trace(TRACE_FS_EXIT, TRACE_FS_LOAD, file->nsectors);
+    return true;
 }
 
-void fs_init(void) {
-    for (unsigned sector = 0; sector < sizeof(disk) / SECTOR_SIZE; sector++)
-        read_write_disk(&disk[sector * SECTOR_SIZE], sector, false);
+/*
+ * fs_clear_tail: 文件要变短到 size 之前调用，清零 data 中新的 EOF 之后的旧数据。
+ * data 中 size 之后的部分始终为零，映射文件最后一页（或者 EOF 之后、容量之内的页）的进程不会看到旧内容。
+ * 没有加载的文件的 size 可能超过容量，只清到容量为止。
+ */
+void fs_clear_tail(struct file *file, size_t size) {
+    size_t end = file->size < file->capacity ? file->size : file->capacity;
+    if (size < end)
+        memset(file->data + size, 0, end - size);
+}
 
-    unsigned off = 0;
-    for (int i = 0; i < FILES_MAX; i++) {
-        struct tar_header *header = (struct tar_header *) &disk[off];
-        if (header->name[0] == '\0')
-            break;
+void fs_mark_dirty(struct file *file, size_t start, size_t end) { // 记录文件中被修改的数据范围
+    if (!file->on_dirty_list) {
+        file->on_dirty_list = true;
+        file->dirty_next = fs_dirty_head;
+        fs_dirty_head = file;
+    }
 
-        if (strcmp(header->magic, "ustar") != 0)
-            PANIC("invalid tar header: magic=\"%s\"", header->magic);
+    if (file->dirty_start == file->dirty_end) {
+        file->dirty_start = start;
+        file->dirty_end = end;
+        return;
+    }
 
-        int filesz = oct2int(header->size, sizeof(header->size));
-        struct file *file = &files[i];
-        file->in_use = true;
-        strcpy(file->name, header->name);
-        memcpy(file->data, header->data, filesz);
-        file->size = filesz;
-        printf("file: %s, size=%d\n", file->name, file->size);
+    if (start < file->dirty_start)
+        file->dirty_start = start;
+    if (end > file->dirty_end)
+        file->dirty_end = end;
+}
 
-        off += align_up(sizeof(struct tar_header) + filesz, SECTOR_SIZE);
+void fs_write_header(struct file *file) { // 重新生成文件的 tar 头，写进缓存
+    struct buf *b = bget(file->sector);
+    struct tar_header *header = (struct tar_header *) b->data;
+    memset(header, 0, sizeof(*header));
+    strcpy(header->name, file->name);
+    strcpy(header->mode, "000644");
+    strcpy(header->magic, "ustar");
+    strcpy(header->version, "00");
+    header->type = '0';
+
+    int filesz = file->size;
+    for (int i = sizeof(header->size); i > 0; i--) {
+        header->size[i - 1] = (filesz % 8) + '0';
+        filesz /= 8;
     }
-}
 
-struct file *fs_lookup(const char *filename) { // 在文件系统中查找文件
-    for (int i = 0; i < FILES_MAX; i++) {
-        struct file *file = &files[i];
-        if (!strcmp(file->name, filename))
-            return file;
+    int checksum = ' ' * sizeof(header->checksum);
+    for (unsigned i = 0; i < sizeof(struct tar_header); i++)
+        checksum += (unsigned char) b->data[i];
+
+    for (int i = 5; i >= 0; i--) {
+        header->checksum[i] = (checksum % 8) + '0';
+        checksum /= 8;
     }
 
-    return NULL;
+    bdirty(b);
+    brelse(b);
+    file->header_dirty = false;
 }
 
-void putchar(char ch) {
-    sbi_call(ch, 0, 0, 0, 0, 0, 0, 1 /* Console Putchar */);
+void fs_write_range(struct file *file, size_t start, size_t end) { // 把文件数据中覆盖 [start, end) 的扇区写进缓存
+    if (end > file->size)
+        end = file->size;
+    if (start >= end)
+        return;
+
+    size_t first = start / SECTOR_SIZE;
+    size_t last = align_up(end, SECTOR_SIZE) / SECTOR_SIZE;
+    size_t last_byte = last * SECTOR_SIZE < file->size ? last * SECTOR_SIZE : file->size;
+    fs_write_data(file->sector + 1 + first, &file->data[first * SECTOR_SIZE],
+                  last_byte - first * SECTOR_SIZE);
 }
 
-long getchar(void) {
-    struct sbiret ret = sbi_call(0, 0, 0, 0, 0, 0, 0, 2);
-    return ret.error;
+/*
+ * fs_move_sectors: 经过块缓存把 count 个数据扇区从 from 移到 to。
+ * 向后移动时从最后一个扇区开始拷贝，向前移动时从第一个开始，源扇区在被覆盖之前一定已经读出。
+ */
+void fs_move_sectors(unsigned from, unsigned to, unsigned count) {
+    for (unsigned k = 0; k < count; k++) {
+        unsigned i = to > from ? count - 1 - k : k;
+        struct buf *src = bread(from + i);
+        struct buf *dst = bget(to + i);
+        memcpy(dst->data, src->data, SECTOR_SIZE);
+        bdirty(dst);
+        brelse(dst);
+        brelse(src);
+    }
 }
 
-__attribute__((naked))
-__attribute__((aligned(4)))  // 该函数4字节对齐
-void kernel_entry(void) {    // 函数功能：在内核栈中保存寄存器状态，然后执行 handle_trap 进行异常处理，最后将寄存器恢复，然后将控制权返回用户态，继续执行用户程序。
+/*
+ * fs_flush: 把修改过的文件写回磁盘，只处理待写回链表中的文件。
+ * 数据占用的扇区数不变的文件原地更新：只重写 tar 头和被修改的数据扇区。
+ * 扇区数变化时，后面所有文件的位置都要移动，从该文件开始重新排列到归档末尾。
+ * 已加载的文件从内存写到新位置；没有加载的文件经过块缓存在磁盘上搬移，不读进内存，
+ * 所以改变一个文件的大小不会让后面的文件常驻内存。
+ * 成功返回 0。重新排列后的归档放不进磁盘，或者写盘失败时返回 -1；前一种情况什么都不写，文件仍然等待写回。
+ */
+int fs_flush(void) {
+    trace(TRACE_FS_ENTER, TRACE_FS_FLUSH, 0);
+    sleeplock_acquire(&fs_lock);
+    int relayout = files_count;
+    for (struct file *file = fs_dirty_head; file; file = file->dirty_next) {
+        int i = file - files;
+        if (i < relayout && align_up(file->size, SECTOR_SIZE) / SECTOR_SIZE != file->nsectors)
+            relayout = i;
+    }
+
+    if (relayout < files_count) { // 重新排列之后的结尾（加上两个结束扇区）必须在磁盘容量之内
+        unsigned end = relayout > 0 ? files[relayout - 1].sector + 1 + files[relayout - 1].nsectors : 0;
+        for (int i = relayout; i < files_count; i++)
+            end += 1 + align_up(files[i].size, SECTOR_SIZE) / SECTOR_SIZE;
+        if (end + 2 > blk_capacity / SECTOR_SIZE) {
+            printf("fs: archive would need %d sectors, disk has %d\n", end + 2, blk_capacity / SECTOR_SIZE);
+            sleeplock_release(&fs_lock);
+            trace(TRACE_FS_EXIT, TRACE_FS_FLUSH, -1);
+            return -1;
+        }
+    }
+
+    while (fs_dirty_head) {
+        struct file *file = fs_dirty_head;
+        fs_dirty_head = file->dirty_next;
+        file->on_dirty_list = false;
+        // 写之前取出并清空脏范围：写的时候可能睡眠，这期间再标记的范围要留给下一次 fs_flush
+        size_t start = file->dirty_start, end = file->dirty_end;
+        file->dirty_start = file->dirty_end = 0;
+        if (file - files < relayout) {
+            if (file->header_dirty)
+                fs_write_header(file);
+            fs_write_range(file, start, end);
+        }
+    }
+
+    if (relayout < files_count) {
+        struct file *prev = relayout > 0 ? &files[relayout - 1] : NULL;
+        unsigned sector = prev ? prev->sector + 1 + prev->nsectors : 0;
+        // 没有加载的文件大小不变，只是整体移动。往前移的按文件顺序搬，往后移的倒序搬，
+        // 这样每个文件的目标位置要么在前面已经搬走的文件上，要么在后面已经搬走的文件上，不会覆盖还没搬的数据。
+        for (int i = relayout; i < files_count; i++) {
+            struct file *file = &files[i];
+            if (file->loaded || sector <= file->sector) {
+                if (!file->loaded && sector < file->sector)
+                    fs_move_sectors(file->sector + 1, sector + 1, file->nsectors);
+                file->sector = sector;
+                file->nsectors = align_up(file->size, SECTOR_SIZE) / SECTOR_SIZE;
+            }
+            sector += 1 + align_up(file->size, SECTOR_SIZE) / SECTOR_SIZE;
+        }
+
+        unsigned next = sector;
+        for (int i = files_count - 1; i >= relayout; i--) {
+            struct file *file = &files[i];
+            unsigned to = next - 1 - file->nsectors;
+            if (to != file->sector) { // 没有加载、需要往后移的文件
+                fs_move_sectors(file->sector + 1, to + 1, file->nsectors);
+                file->sector = to;
+            }
+            next = to;
+        }
+
+        // 数据都到了新位置之后再写 tar 头和已加载文件的内容，它们不会覆盖任何还要读的扇区
+        for (int i = relayout; i < files_count; i++) {
+            fs_write_header(&files[i]);
+            if (files[i].loaded)
+                fs_write_range(&files[i], 0, files[i].size);
+        }
+
+        // 归档可能变短：把原来的末尾清零，并保证有两个全零扇区作为 tar 的结束标记
+        unsigned end = fs_end_sector > sector + 2 ? fs_end_sector : sector + 2;
+        if (end > blk_capacity / SECTOR_SIZE) // 原来的归档超出了磁盘（不应该发生），只清零磁盘内的部分
+            end = blk_capacity / SECTOR_SIZE;
+        for (unsigned zero = sector; zero < end; zero++)
+            fs_write_data(zero, "", 1);
+        fs_end_sector = sector;
+    }
+
+    uint64_t start = read_time();
+    int written = bsync();
+    if (written < 0)
+        printf("fs: failed to write back to disk\n");
+    else
+        printf("wrote %d bytes to disk in %d us (bcache: %d hits, %d misses)\n",
+               written * SECTOR_SIZE, (uint32_t) (read_time() - start) / (TIMER_FREQ / 1000000),
+               bcache_hits, bcache_misses);
+    sleeplock_release(&fs_lock);
+    trace(TRACE_FS_EXIT, TRACE_FS_FLUSH, written);
+    return written < 0 ? -1 : 0;
+}
+
+/*
+ * fs_init: 挂载文件系统。只读取每个文件的 tar 头，跳过数据扇区，记录文件在磁盘上的位置。
+ * 文件内容在第一次读取时由 fs_load 加载，所以启动时间只与文件个数有关，与文件大小无关。
+ */
+void fs_init(void) {
+    bcache_init();
+
+    uint64_t start = read_time();
+    unsigned sector = 0;
+    while (sector < blk_capacity / SECTOR_SIZE) {
+        struct buf *b = bread(sector);
+        struct tar_header *header = (struct tar_header *) b->data;
+        if (header->name[0] == '\0') {
+            brelse(b);
+            break;
+        }
+
+        if (strcmp(header->magic, "ustar") != 0)
+            PANIC("invalid tar header: magic=\"%s\"", header->magic);
+
+        if (files_count == FILES_MAX)
+            PANIC("too many files");
+
+        int filesz = oct2int(header->size, sizeof(header->size));
+        struct file *file = &files[files_count++];
+        file->in_use = true;
+        strcpy(file->name, header->name);
+        file->size = filesz;
+        file->sector = sector;
+        file->nsectors = align_up(filesz, SECTOR_SIZE) / SECTOR_SIZE;
+        brelse(b);
+        printf("file: %s, size=%d%s\n", file->name, file->size,
+               file->size > FILE_SIZE_MAX ? " (too large to open)" : "");
+
+        uint32_t h = fs_hash(file->name);
+        file->hash_next = file_hash[h];
+        file_hash[h] = file;
+
+        sector += 1 + file->nsectors;
+    }
+
+    fs_end_sector = sector;
+    printf("mounted %d files in %d us\n", files_count,
+           (uint32_t) (read_time() - start) / (TIMER_FREQ / 1000000));
+}
+
+struct file *fs_lookup(const char *filename) { // 通过文件名哈希表查找文件，O(1)
+    struct file *file = file_hash[fs_hash(filename)];
+    while (file && strcmp(file->name, filename) != 0)
+        file = file->hash_next;
+
+    return file;
+}
+
+/*
+ * fs_replace: 用内核生成的内容覆盖一个已经存在的文件并写回磁盘，返回文件大小，失败返回 -1。
+ * fill 把最多 max 字节写进文件的数据页并返回实际大小。它在持有 fs_lock 时调用，不能睡眠。
+ */
+int fs_replace(const char *filename, size_t max, size_t (*fill)(uint8_t *data)) {
+    struct file *file = fs_lookup(filename);
+    if (!file)
+        return -1;
+
+    sleeplock_acquire(&fs_lock);
+    if (!fs_reserve(file, max)) {
+        sleeplock_release(&fs_lock);
+        return -1;
+    }
+    file->loaded = true; // 整个文件被覆盖，不需要先加载原来的内容；容量分配成功之后才能设置
+
+    size_t size = fill(file->data);
+    fs_clear_tail(file, size);
+    if (file->size != size)
+        file->header_dirty = true;
+    file->size = size;
+    fs_mark_dirty(file, 0, size);
+    sleeplock_release(&fs_lock);
+    return fs_flush() < 0 ? -1 : (int) size;
+}
+
+void putchar(char ch) {
+    sbi_call(ch, 0, 0, 0, 0, 0, 0, 1 /* Console Putchar */);
+}
+
+bool sbi_has_dbcn; // SBI 实现是否支持 Debug Console 扩展
+
+void console_init(void) {
+    struct sbiret ret = sbi_call(SBI_EXT_DBCN, 0, 0, 0, 0, 0, SBI_BASE_PROBE_EXT, SBI_EXT_BASE);
+    sbi_has_dbcn = ret.error == 0 && ret.value != 0;
+}
+
+/*
+ * console_write: 输出 buf 开始的 len 个字符。buf 必须是物理地址（内核中的地址与物理地址相同）。
+ * 有 DBCN 扩展时一次 SBI 调用输出一整段，否则退回到逐个字符的 Console Putchar。
+ */
+void console_write(const char *buf, size_t len) {
+    while (len > 0) {
+        if (sbi_has_dbcn) {
+            struct sbiret ret = sbi_call(len, (paddr_t) buf, 0, 0, 0, 0, SBI_DBCN_WRITE, SBI_EXT_DBCN);
+            if (ret.error == 0 && ret.value > 0) { // 可能只写出了一部分
+                buf += ret.value;
+                len -= ret.value;
+                continue;
+            }
+        }
+
+        putchar(*buf++);
+        len--;
+    }
+}
+
+struct tty tty;
+
+void uart_write_reg(uint32_t reg, uint8_t value) {
+    *((volatile uint8_t *) (UART_PADDR + reg)) = value;
+}
+
+uint8_t uart_read_reg(uint32_t reg) {
+    return *((volatile uint8_t *) (UART_PADDR + reg));
+}
+
+void uart_init(void) { // 打开串口的接收中断；输出仍然经过 SBI
+    uart_write_reg(UART_IER, UART_IER_RX);
+    uart_write_reg(UART_MCR, uart_read_reg(UART_MCR) | UART_MCR_OUT2);
+}
+
+/*
+ * tty_input: 行规程。处理串口收到的一个字符：回显，退格删除正在编辑的字符，
+ * 回车结束一行并唤醒等待输入的进程。缓冲区满时丢弃输入。
+ */
+void tty_input(char ch) {
+    switch (ch) {
+        case '\b':
+        case 0x7f: // Backspace / Delete
+            if (tty.edit != tty.commit) {
+                tty.edit--;
+                console_write("\b \b", 3);
+            }
+            break;
+        case '\r':
+        case '\n':
+            if (tty.edit - tty.read < TTY_BUF_SIZE) {
+                tty.buf[tty.edit++ % TTY_BUF_SIZE] = '\n';
+                console_write("\n", 1);
+                tty.commit = tty.edit;
+                wake_up(&tty.readers);
+            }
+            break;
+        default:
+            if (tty.edit - tty.read < TTY_BUF_SIZE - 1) { // 留一个位置给换行
+                tty.buf[tty.edit++ % TTY_BUF_SIZE] = ch;
+                console_write(&ch, 1);
+            }
+    }
+}
+
+void uart_handle_irq(void) { // 取出串口 FIFO 中的所有字符
+    while (uart_read_reg(UART_LSR) & UART_LSR_DR)
+        tty_input(uart_read_reg(UART_RBR));
+}
+
+/*
+ * tty_read: 读取一行输入（包括结尾的换行），最多 len 个字符。没有完整的一行时睡眠等待。
+ * buf 已经映射好。返回读到的字符数。
+ */
+int tty_read(char *buf, int len) {
+    while (tty.read == tty.commit)
+        sleep_on(&tty.readers);
+
+    int n = 0;
+    while (n < len && tty.read != tty.commit) {
+        char ch = tty.buf[tty.read++ % TTY_BUF_SIZE];
+        buf[n++] = ch;
+        if (ch == '\n')
+            break;
+    }
+    return n;
+}
+
+struct process *timer_head; // 定时器队列：sleep 中的进程，按 wake_time 从早到晚排列
+
+void timer_set(uint64_t deadline) { // 设置定时器中断的时刻，TIMER_NEVER 表示不需要中断；剖析时下一次采样如果更早就先触发
+    struct cpu *cpu = this_cpu();
+    cpu->timer_deadline = deadline;
+    if (profile_running && cpu->profile_next < deadline)
+        deadline = cpu->profile_next;
+    sbi_call(deadline, deadline >> 32, 0, 0, 0, 0, 0 /* set_timer */, SBI_EXT_TIME);
+}
+
+void timer_arm(void) { // 设置下一次定时器中断：一个时间片之后，如果有进程更早醒来则提前
+    uint64_t deadline = read_time() + TIMER_FREQ / 1000 * TIME_SLICE_MS;
+    if (timer_head && timer_head->wake_time < deadline)
+        deadline = timer_head->wake_time;
+    timer_set(deadline);
+}
+
+void timer_expire(void) { // 唤醒所有睡眠时间已经到了的进程
+    uint64_t now = read_time();
+    while (timer_head && timer_head->wake_time <= now) {
+        struct process *proc = timer_head;
+        timer_head = proc->timer_next;
+        proc->timer_next = NULL;
+        proc->state = PROC_RUNNABLE;
+        runq_push(proc);
+    }
+}
+
+void sleep_until(uint64_t wake_time) { // 当前进程加入定时器队列，睡眠到 wake_time
+    struct process **link = &timer_head;
+    while (*link && (*link)->wake_time <= wake_time)
+        link = &(*link)->timer_next;
+
+    current_proc->wake_time = wake_time;
+    current_proc->timer_next = *link;
+    *link = current_proc;
+    current_proc->state = PROC_BLOCKED;
+    timer_arm();  // 可能比当前的时间片先到期
+    yield();
+}
+
+void profile_record(struct cpu *cpu, uint32_t pc, bool user) { // 在本 hart 的 PC 直方图中给 (pc, pid, 特权级) 加一，表满时丢弃
+    struct process *proc = cpu->current;
+    uint16_t pid = proc ? proc->pid : 0;
+    uint32_t h = (((pc >> 1) ^ pid) * 2654435761u) >> 16;
+    for (int i = 0; i < PROFILE_ENTRIES; i++) { // 开放寻址，线性探测
+        struct profile_entry *e = &cpu->profile[(h + i) % PROFILE_ENTRIES];
+        if (e->count == 0) {
+            e->pc = pc;
+            e->pid = pid;
+            e->user = user;
+            strcpy(e->name, proc ? proc->name : "");
+            e->count = 1;
+            return;
+        }
+        if (e->pc == pc && e->pid == pid && e->user == user) {
+            e->count++;
+            return;
+        }
+    }
+    cpu->profile_dropped++;
+}
+
+/*
+ * profile_tick: 定时器中断时调用。采样时刻到了就记录被打断的 pc。
+ * 如果调度的定时器还没到期（只是采样用的中断），重新设置定时器并返回 true，调用者不需要再处理这个中断。
+ */
+bool profile_tick(uint32_t pc, bool user) {
+    struct cpu *cpu = this_cpu();
+    uint64_t now = read_time();
+    if (profile_running && now >= cpu->profile_next) {
+        profile_record(cpu, pc, user);
+        cpu->profile_next = now + TIMER_FREQ / PROFILE_FREQ;
+    }
+
+    if (now >= cpu->timer_deadline) {
+        // 调度定时器到期，交给调用者处理。从用户态陷入时调用者还没有拿锁：先把硬件定时器推到下一次采样，
+        // 清除 STIP，否则拿锁打开 SIE 后会立刻陷入 profile_entry；调用者处理完后由 timer_arm 重新设置
+        if (user && profile_running)
+            sbi_call(cpu->profile_next, cpu->profile_next >> 32, 0, 0, 0, 0, 0 /* set_timer */, SBI_EXT_TIME);
+        return false;
+    }
+
+    timer_set(cpu->timer_deadline);
+    return true;
+}
+
+/*
+ * profile_kernel_tick: 持有大内核锁的内核代码被中断时由 profile_entry 调用。
+ * 被打断的代码可能正在修改任何共享数据，这里只能访问本 hart 的直方图和定时器。
+ * 其他中断和到期的调度定时器留到返回用户态（或者空闲进程轮询）时处理：清除 SPIE，sret 之后本次内核态不再被中断。
+ */
+void profile_kernel_tick(void) {
+    uint32_t scause = READ_CSR(scause);
+    if (!(scause & SCAUSE_INTERRUPT))
+        PANIC("unexpected trap in kernel scause=%x, stval=%x, sepc=%x\n", scause, READ_CSR(stval), READ_CSR(sepc));
+    if (scause != (SCAUSE_INTERRUPT | IRQ_S_TIMER) || !profile_tick(READ_CSR(sepc), false))
+        __asm__ __volatile__("csrc sstatus, %0" :: "r"(SSTATUS_SPIE));
+}
+
+__attribute__((naked))
+__attribute__((aligned(4)))
+void profile_entry(void) { // 内核态中断的入口：仍然使用当前的内核栈，只需要保存调用者保存的寄存器
+    __asm__ __volatile__(
+        "addi sp, sp, -4 * 16\n"
+        "sw ra,  4 * 0(sp)\n"
+        "sw t0,  4 * 1(sp)\n"
+        "sw t1,  4 * 2(sp)\n"
+        "sw t2,  4 * 3(sp)\n"
+        "sw t3,  4 * 4(sp)\n"
+        "sw t4,  4 * 5(sp)\n"
+        "sw t5,  4 * 6(sp)\n"
+        "sw t6,  4 * 7(sp)\n"
+        "sw a0,  4 * 8(sp)\n"
+        "sw a1,  4 * 9(sp)\n"
+        "sw a2,  4 * 10(sp)\n"
+        "sw a3,  4 * 11(sp)\n"
+        "sw a4,  4 * 12(sp)\n"
+        "sw a5,  4 * 13(sp)\n"
+        "sw a6,  4 * 14(sp)\n"
+        "sw a7,  4 * 15(sp)\n"
+        "call profile_kernel_tick\n"
+        "lw ra,  4 * 0(sp)\n"
+        "lw t0,  4 * 1(sp)\n"
+        "lw t1,  4 * 2(sp)\n"
+        "lw t2,  4 * 3(sp)\n"
+        "lw t3,  4 * 4(sp)\n"
+        "lw t4,  4 * 5(sp)\n"
+        "lw t5,  4 * 6(sp)\n"
+        "lw t6,  4 * 7(sp)\n"
+        "lw a0,  4 * 8(sp)\n"
+        "lw a1,  4 * 9(sp)\n"
+        "lw a2,  4 * 10(sp)\n"
+        "lw a3,  4 * 11(sp)\n"
+        "lw a4,  4 * 12(sp)\n"
+        "lw a5,  4 * 13(sp)\n"
+        "lw a6,  4 * 14(sp)\n"
+        "lw a7,  4 * 15(sp)\n"
+        "addi sp, sp, 4 * 16\n"
+        "sret\n"                    // 回到被打断的内核代码，sepc 和特权级由硬件保存
+    );
+}
+
+__attribute__((naked))
+__attribute__((aligned(4)))  // 该函数4字节对齐
+void kernel_entry(void) {    // 函数功能：在内核栈中保存寄存器状态，然后执行 handle_trap 进行异常处理，最后将寄存器恢复，然后将控制权返回用户态，继续执行用户程序。
     __asm__ __volatile__(
         "csrrw sp, sscratch, sp\n"  // 这的 sp 存放用户态栈，sscratch 存放内核态栈。这句代码是 sp 和 sscratch 值互换。将用户态 sp 放在 sscratch，以便恢复到用户态时使用。
         "addi sp, sp, -4 * 31\n"    // 这里 sp 已经是是内核态栈了，这里是向下移动出31个寄存器的状态空间。（上一句代码中 sp 值 变成了 sscratch 寄存器中原来存着的内核态 sp）。
@@ -311,6 +1502,7 @@ void kernel_entry(void) {    // 函数功能：在内核栈中保存寄存器状
         "sw s9,  4 * 27(sp)\n"
         "sw s10, 4 * 28(sp)\n"
         "sw s11, 4 * 29(sp)\n"
+        "lw tp,  4 * 31(sp)\n"    // 内核栈顶保留的字：当前 hart 的 struct cpu
 
         "csrr a0, sscratch\n" 
         "sw a0,  4 * 30(sp)\n"    // 将用户态栈 sp 也放到内核态 sp 中
@@ -321,6 +1513,8 @@ void kernel_entry(void) {    // 函数功能：在内核栈中保存寄存器状
         "mv a0, sp\n"             // sp 现在又是内核态 sp 了
         "call handle_trap\n"      // 调用处理函数 handle_trap
 
+        "trap_return:\n"          // fork_return 也从这里恢复子进程的寄存器
+        "call kernel_lock_release\n" // 返回用户态，释放大内核锁
         "lw ra,  4 * 0(sp)\n"     // 恢复上下文
         "lw gp,  4 * 1(sp)\n"
         "lw tp,  4 * 2(sp)\n"
@@ -358,12 +1552,12 @@ void kernel_entry(void) {    // 函数功能：在内核栈中保存寄存器状
 
 __attribute__((naked)) void user_entry(void) { // 实现内核态到用户态的切换。
     __asm__ __volatile__(
-        "csrw sepc, %[sepc]\n"        // sepc 保存发生异常时的程序计数器值，用于异常后恢复到用户态执行。
+        "call kernel_lock_release\n"  // 返回用户态，释放大内核锁
+        "csrw sepc, s0\n"             // s0 是 create_process 放在栈上的程序入口地址，sepc 是 sret 之后开始执行的位置。
         "csrw sstatus, %[sstatus]\n"  // 设置状态寄存器的标志，控制终端和用户态的访问权限。
         "sret\n"                      // 从超级模式返回到用户模式。根据 sstatus 的设置恢复到用户态，跳转到 sepc 的位置。
         :
-        : [sepc] "r" (USER_BASE),
-          [sstatus] "r" (SSTATUS_SPIE | SSTATUS_SUM)
+        : [sstatus] "r" (SSTATUS_SPIE | SSTATUS_SUM)
     );
 }
 
@@ -373,6 +1567,16 @@ __attribute__((naked)) void user_entry(void) { // 实现内核态到用户态的
  * 将 next_sp（接下来运行的进程的栈）中保存的寄存器状态放到寄存器里面，以便接下来切换到下一个进程。 
  */
 
+__attribute__((naked)) void fork_return(void) { // fork 出的子进程第一次被调度时从这里返回用户态
+    __asm__ __volatile__(
+        "csrw sstatus, %[sstatus]\n"  // 先关中断（剖析时可能开着），再写 sepc
+        "csrw sepc, s0\n"             // s0 是 sys_fork 放在栈上的用户态返回地址（ecall 的下一条指令）
+        "j trap_return\n"             // sp 指向从父进程拷贝来的 trap_frame，按 kernel_entry 的方式恢复后 sret
+        :
+        : [sstatus] "r" (SSTATUS_SPIE | SSTATUS_SUM)
+    );
+}
+
 __attribute__((naked)) void switch_context(uint32_t *prev_sp,    // 多任务上下文切换
                                            uint32_t *next_sp) {  // 参数是前后两个任务的栈指针
     __asm__ __volatile__(
@@ -410,11 +1614,91 @@ __attribute__((naked)) void switch_context(uint32_t *prev_sp,    // 多任务上
     );
 }
 
+struct vma *vma_alloc(struct process *proc) { // 取一个空闲的区域，没有则返回 NULL
+    for (int i = 0; i < VMAS_MAX; i++) {
+        if (!proc->vmas[i].kind)
+            return &proc->vmas[i];
+    }
+    return NULL;
+}
+
+bool elf_check(const uint8_t *image, size_t image_size) { // 检查 ELF 镜像的文件头和各个 PT_LOAD 段是否有效
+    const struct elf32_ehdr *ehdr = (const struct elf32_ehdr *) image;
+    if (!image || image_size < sizeof(*ehdr) || ehdr->magic != ELF_MAGIC
+        || ehdr->machine != EM_RISCV || ehdr->entry == 0
+        || ehdr->phoff > image_size
+        || ehdr->phnum * sizeof(struct elf32_phdr) > image_size - ehdr->phoff)
+        return false;
+
+    int segments = 0;
+    for (int i = 0; i < ehdr->phnum; i++) {
+        const struct elf32_phdr *phdr =
+            (const struct elf32_phdr *) (image + ehdr->phoff + i * sizeof(struct elf32_phdr));
+        if (phdr->type != PT_LOAD || phdr->memsz == 0)
+            continue;
+
+        // 用减法比较，避免磁盘上的镜像用回绕的 offset/vaddr 绕过检查
+        if (phdr->offset > image_size || phdr->filesz > image_size - phdr->offset
+            || phdr->filesz > phdr->memsz
+            || phdr->vaddr < USER_BASE || phdr->vaddr >= MMAP_BASE
+            || phdr->memsz > MMAP_BASE - phdr->vaddr
+            || phdr->offset < phdr->vaddr % PAGE_SIZE)
+            return false;
+
+        // 与内核共享的一级页表项（PLIC 大页、UART/virtio 的二级页表）不能拿来映射用户页面
+        for (vaddr_t vpn1 = phdr->vaddr >> 22; vpn1 <= (phdr->vaddr + phdr->memsz - 1) >> 22; vpn1++) {
+            if (kernel_page_table[vpn1])
+                return false;
+        }
+        segments++;
+    }
+    return segments <= VMAS_MAX;
+}
+
+/*
+ * elf_load: 为 ELF 镜像的每个 PT_LOAD 段建立一个按需映射的区域，不分配也不拷贝任何页面。
+ * 每个段使用自己的权限；memsz 超出 filesz 的部分（bss、栈）在第一次访问时填零。
+ * file 是镜像所在的文件（内嵌的程序为 NULL），映射期间文件的数据不能被重新分配。
+ * 镜像必须先经过 elf_check，进程的区域必须为空。返回入口地址。
+ */
+vaddr_t elf_load(struct process *proc, const uint8_t *image, struct file *file) {
+    const struct elf32_ehdr *ehdr = (const struct elf32_ehdr *) image;
+    for (int i = 0; i < ehdr->phnum; i++) {
+        const struct elf32_phdr *phdr =
+            (const struct elf32_phdr *) (image + ehdr->phoff + i * sizeof(struct elf32_phdr));
+        if (phdr->type != PT_LOAD || phdr->memsz == 0)
+            continue;
+
+        struct vma *vma = vma_alloc(proc);
+        size_t head = phdr->vaddr % PAGE_SIZE; // 段起始地址到所在页开头的距离
+        vma->kind = VMA_IMAGE;
+        vma->start = phdr->vaddr - head;
+        vma->end = align_up(phdr->vaddr + phdr->memsz, PAGE_SIZE);
+        vma->prot = (phdr->flags & PF_R ? PAGE_R : 0) | (phdr->flags & PF_W ? PAGE_W : 0)
+                  | (phdr->flags & PF_X ? PAGE_X : 0);
+        vma->image = image + phdr->offset - head;
+        vma->filesz = phdr->filesz + head;
+        vma->file = file;
+        if (file)
+            file->map_count++;
+    }
+
+    return ehdr->entry;
+}
+
+/*
+ * kernel_stack_top: 内核栈顶部保留一个字，存放进程当前所在 hart 的 struct cpu（由 yield 写入），
+ * kernel_entry 从这里恢复 tp。返回这个字的地址，栈从它下面开始使用。
+ */
+uint32_t *kernel_stack_top(struct process *proc) {
+    return (uint32_t *) &proc->stack[sizeof(proc->stack)] - 1;
+}
+
 /*
  * create_process: 创建新进程。 
  * 查找空闲的进程槽
  * 初始化进程栈和寄存器状态
- * 分配、设置进程的页表（分别建立内核程序、虚拟块设备、用户程序物理页面与虚拟页面的映射）
+ * 分配、设置进程的页表（共享内核程序、虚拟块设备的映射，用户程序按 ELF 段按需映射）
  * 设置进程的 id 和状态。
  */
 
@@ -431,7 +1715,7 @@ struct process *create_process(const void *image, size_t image_size) { // 参数
     if (!proc)
         PANIC("no free process slots");  // 如果没有空闲进程，则调用 PANIC
 
-    uint32_t *sp = (uint32_t *) &proc->stack[sizeof(proc->stack)]; // sp 初始化为进程栈的栈顶
+    uint32_t *sp = kernel_stack_top(proc); // sp 初始化为进程栈的栈顶
     *--sp = 0;                      // s11  依次设置的栈中的寄存器值
     *--sp = 0;                      // s10
     *--sp = 0;                      // s9
@@ -443,103 +1727,825 @@ struct process *create_process(const void *image, size_t image_size) { // 参数
     *--sp = 0;                      // s3
     *--sp = 0;                      // s2
     *--sp = 0;                      // s1
-    *--sp = 0;                      // s0
+    *--sp = 0;                      // s0  （程序入口地址，加载镜像后填入）
     *--sp = (uint32_t) user_entry;  // ra （返回地址寄存器），ra 设置为user_entry，表示进程开始执行的入口点。user_entry 是内核态切换为用户态的入口处。
 
-    uint32_t *page_table = (uint32_t *) alloc_pages(1);  // 分配一个页表，用来管理进程的虚拟地址空间映射（虚拟地址空间是连续的，与物理内存空间有映射关系，虚拟地址空间便于进程的安全性、隔离性、灵活性）
+    uint32_t *page_table = (uint32_t *) alloc_pages(1);  // 内存不足时返回 NULL，进程槽位保持空闲。分配一个页表，用来管理进程的虚拟地址空间映射（虚拟地址空间是连续的，与物理内存空间有映射关系，虚拟地址空间便于进程的安全性、隔离性、灵活性）
 
-    // Kernel pages. 建立虚拟页面与内核态物理内存页面之间的映射（内核态没有用到虚拟页面）
-    for (paddr_t paddr = (paddr_t) __kernel_base;
-         paddr < (paddr_t) __free_ram_end; paddr += PAGE_SIZE)
-        map_page(page_table, paddr, paddr, PAGE_R | PAGE_W | PAGE_X);
+    if (!page_table)
+        return NULL;
 
-    // virtio-blk  虚拟块设备的映射
-    map_page(page_table, VIRTIO_BLK_PADDR, VIRTIO_BLK_PADDR, PAGE_R | PAGE_W);
+    // Kernel pages. 内核页面和虚拟块设备的映射在 kernel_vm_init 中只建立一次，这里直接共享其一级页表项。
+    memcpy(page_table, kernel_page_table, PAGE_SIZE);
 
-    // User pages. 为用户程序分配物理页面并存放，然后进行虚拟页面地址映射。
-    for (uint32_t off = 0; off < image_size; off += PAGE_SIZE) {
-        paddr_t page = alloc_pages(1);
-        size_t remaining = image_size - off;
-        size_t copy_size = PAGE_SIZE <= remaining ? PAGE_SIZE : remaining;
-        memcpy((void *) page, image + off, copy_size);
-        map_page(page_table, USER_BASE + off, page,
-                 PAGE_U | PAGE_R | PAGE_W | PAGE_X);
+    proc->page_table = page_table;
+    memset(proc->vmas, 0, sizeof(proc->vmas));
+    proc->resident_pages = 0;
+
+    // User pages. 只为用户程序的各个段登记按需映射的区域，页面在第一次访问发生缺页时才映射。
+    if (image) {
+        if (!elf_check(image, image_size))
+            PANIC("invalid user image");
+        sp[1] = elf_load(proc, image, NULL); // s0：user_entry 从这里取得程序入口地址
     }
 
     proc->pid = i + 1;
     proc->state = PROC_RUNNABLE;
+    proc->cpu = NULL;
+    proc->parent = NULL;
+    proc->children = 0;
+    proc->exited_children = 0;
+    proc->child_wait.head = NULL;
+    proc->asid_generation = 0;  // 还没有分配 ASID，第一次被调度时分配
+    memset(proc->fds, 0, sizeof(proc->fds));
+    proc->mmap_next = MMAP_BASE;
     proc->sp = (uint32_t) sp;
-    proc->page_table = page_table;
+    if (image)
+        runq_push(proc);        // 空闲进程不进入就绪队列
     return proc;
 }
 
 /*
  * yield 实现进程调度。
- * 寻找下一个可运行的进程
+ * 从就绪队列中取出下一个可运行的进程
  * 更新页表、栈指针
  * 切换上下文（切换寄存器状态）
  */
 void yield(void) {
-    struct process *next = idle_proc;
-    for (int i = 0; i < PROCS_MAX; i++) {  // 遍历进程组，找到下一个正在等待运行的进程。
-        struct process *proc = &procs[(current_proc->pid + i) % PROCS_MAX];
-        if (proc->state == PROC_RUNNABLE && proc->pid > 0) {
-            next = proc;
-            break;
-        }
-    }
-
-    if (next == current_proc)
+    // 当前进程如果还可以运行，就排到本 hart 就绪队列尾部，然后取出队列头部的进程；
+    // 本 hart 没有可运行的进程时，从其他 hart 偷一个。
+    struct cpu *cpu = this_cpu();
+    struct process *prev = cpu->current;
+    if (prev->state == PROC_RUNNABLE && prev != cpu->idle)
+        runq_push(prev);
+
+    struct process *next = runq_pop(cpu);
+    if (!next)
+        next = runq_steal(cpu);
+    if (!next)
+        next = cpu->idle;  // 没有可运行的进程
+
+    if (next == prev)
         return;
 
-    struct process *prev = current_proc;
-    current_proc = next;
-
+    kstats.context_switches++;
+    if (next == boot_shell) {
+        // time 计数器从机器复位开始计数，包括 OpenSBI 的启动时间；bench.py 用它衡量启动到 shell 的耗时
+        printf("boot: first switch to shell %d us after reset\n", (uint32_t) (read_time() / (TIMER_FREQ / 1000000)));
+        boot_shell = NULL;
+    }
+    cpu->current = next;
+    trace(TRACE_SWITCH, prev->pid, 0);
+    if (prev == cpu->idle)
+        timer_arm();  // 空闲时定时器可能被关闭了，重新开始时间片
+
+    int flush = asid_assign(next);
+    if (cpu->asid_generation != asid_generation) {
+        cpu->asid_generation = asid_generation; // 其他 hart 开始了新的一代 ASID，本 hart 的 TLB 全部作废
+        flush = ASID_FLUSH_ALL;
+    } else if (next->cpu != cpu && flush == ASID_FLUSH_NONE) {
+        flush = ASID_FLUSH_ONE; // 在其他 hart 上运行时页表可能改过，本 hart 上残留的表项没有刷新
+    }
+    if (TLB_FLUSH_ALL)
+        flush = ASID_FLUSH_ALL;
+    next->cpu = cpu;
+    *kernel_stack_top(next) = (uint32_t) cpu;
     __asm__ __volatile__(                // 内联汇编更新页表和栈指针
-        "sfence.vma\n"                   // 确保更新虚拟地址空间
-        "csrw satp, %[satp]\n"           // 设置新的页表寄存器
-        "sfence.vma\n"                   // 确保更新虚拟地址空间
+        "csrw satp, %[satp]\n"           // 设置新的页表寄存器（带上 ASID，其他进程的 TLB 表项得以保留）
         "csrw sscratch, %[sscratch]\n"   // 设置新的临时寄存器，指向下一个进程的栈
         :
-        : [satp] "r" (SATP_SV32 | ((uint32_t) next->page_table / PAGE_SIZE)),
-          [sscratch] "r" ((uint32_t) &next->stack[sizeof(next->stack)])
+        : [satp] "r" (SATP_SV32 | (next->asid << SATP_ASID_SHIFT)
+                      | ((uint32_t) next->page_table / PAGE_SIZE)),
+          [sscratch] "r" ((uint32_t) kernel_stack_top(next))
     );
 
+    // 只有 ASID 是新分配的、或者进程换了 hart 的时候才需要刷新：新 ASID 可能残留上一代的表项，
+    // 同时也保证新建页表的写入对页表遍历可见。
+    if (flush == ASID_FLUSH_ALL)
+        __asm__ __volatile__("sfence.vma" ::: "memory");
+    else if (flush == ASID_FLUSH_ONE)
+        __asm__ __volatile__("sfence.vma zero, %0" :: "r"(next->asid) : "memory");
+
+    // 已退出的进程不会再被调度：satp 已经切换到 next 的页表，可以安全地回收它的页表和用户页面。
+    // 内核栈在 procs[] 里，switch_context 还要用它保存寄存器，但之后这个槽位可以被重新使用。
+    if (prev->state == PROC_EXITED) {
+        free_page_table(prev->page_table);
+        prev->page_table = NULL;
+        prev->state = PROC_UNUSED;
+    }
+
     switch_context(&prev->sp, &next->sp);  // 寄存器状态保存和切花，为进程切换做准备。
 }
 
+struct file_desc *fd_get(int fd) { // 取得当前进程打开的文件描述符，无效时返回 NULL
+    if (fd < 0 || fd >= FDS_MAX || !current_proc->fds[fd].file)
+        return NULL;
+    return &current_proc->fds[fd];
+}
+
+int fd_open(const char *filename) {
+    struct file *file = fs_lookup(filename);
+    if (!file)
+        return -1;
+
+    for (int fd = FD_FIRST; fd < FDS_MAX; fd++) {
+        if (!current_proc->fds[fd].file) {
+            current_proc->fds[fd].file = file;
+            current_proc->fds[fd].offset = 0;
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+int fd_read(struct file_desc *desc, char *buf, int len) { // 从当前位置读取，只拷贝请求的范围
+    if (len < 0)
+        return -1;
+
+    struct file *file = desc->file;
+    trace(TRACE_FS_ENTER, TRACE_FS_READ, file - files);
+    sleeplock_acquire(&fs_lock);
+    if (!fs_load(file)) {
+        sleeplock_release(&fs_lock);
+        trace(TRACE_FS_EXIT, TRACE_FS_READ, -1);
+        return -1;
+    }
+    if (desc->offset >= file->size)
+        len = 0;
+    else if ((size_t) len > file->size - desc->offset)
+        len = file->size - desc->offset;
+
+    memcpy(buf, file->data + desc->offset, len);
+    desc->offset += len;
+    sleeplock_release(&fs_lock);
+    trace(TRACE_FS_EXIT, TRACE_FS_READ, len);
+    return len;
+}
+
+int fd_write(struct file_desc *desc, const char *buf, int len) { // 在当前位置写入，只把写入的范围标记为脏
+    if (len < 0)
+        return -1;
+
+    struct file *file = desc->file;
+    size_t end = desc->offset + len;
+    trace(TRACE_FS_ENTER, TRACE_FS_WRITE, file - files);
+    sleeplock_acquire(&fs_lock);
+    if (!fs_load(file) || !fs_reserve(file, end)) {
+        sleeplock_release(&fs_lock);
+        trace(TRACE_FS_EXIT, TRACE_FS_WRITE, -1);
+        return -1;
+    }
+
+    if (desc->offset > file->size) // 跳过的部分补零
+        memset(file->data + file->size, 0, desc->offset - file->size);
+
+    memcpy(file->data + desc->offset, buf, len);
+    if (end > file->size) {
+        fs_mark_dirty(file, file->size < desc->offset ? file->size : desc->offset, end);
+        file->size = end;
+        file->header_dirty = true;
+    } else {
+        fs_mark_dirty(file, desc->offset, end);
+    }
+
+    desc->offset = end;
+    sleeplock_release(&fs_lock);
+    trace(TRACE_FS_EXIT, TRACE_FS_WRITE, len);
+    return len;
+}
+
+int fd_lseek(struct file_desc *desc, int offset, int whence) {
+    int base;
+    switch (whence) {
+        case SEEK_SET: base = 0; break;
+        case SEEK_CUR: base = desc->offset; break;
+        case SEEK_END: base = desc->file->size; break;
+        default: return -1;
+    }
+
+    if (base + offset < 0)
+        return -1;
+
+    desc->offset = base + offset;
+    return desc->offset;
+}
+
+int fd_close(struct file_desc *desc) { // 关闭文件，有修改就写回磁盘，写回失败返回 -1（描述符仍然关闭）
+    bool dirty = desc->file->on_dirty_list;
+    desc->file = NULL;
+    return dirty ? fs_flush() : 0;
+}
+
+struct vma *vma_find(struct process *proc, vaddr_t vaddr) {
+    for (int i = 0; i < VMAS_MAX; i++) {
+        struct vma *vma = &proc->vmas[i];
+        if (vma->kind && vma->start <= vaddr && vaddr < vma->end)
+            return vma;
+    }
+    return NULL;
+}
+
+/*
+ * handle_page_fault: 处理用户地址空间的缺页，在 vaddr 所在的区域中按需建立映射。
+ * 返回 false 表示访问非法，或者内存不足无法建立映射（打印提示），调用者结束进程或者让系统调用失败。
+ */
+bool handle_page_fault(vaddr_t vaddr, uint32_t scause) {
+    struct vma *vma = vma_find(current_proc, vaddr);
+    if (!vma)
+        return false;
+
+    uint32_t need = scause == SCAUSE_STORE_PAGE_FAULT ? PAGE_W
+                  : scause == SCAUSE_INST_PAGE_FAULT ? PAGE_X : PAGE_R;
+    if (!(vma->prot & need))
+        return false;
+
+    vaddr_t page = vaddr & ~(PAGE_SIZE - 1);
+    uint32_t *pte = lookup_pte(current_proc->page_table, page);
+    if (pte && (*pte & PAGE_V) && (*pte & PAGE_COW) && scause == SCAUSE_STORE_PAGE_FAULT) {
+        // 写时复制：只剩自己在用就直接恢复写权限，否则拷贝一份
+        paddr_t old = (*pte >> 10) * PAGE_SIZE;
+        paddr_t paddr = old;
+        if (page_desc(old)->refs > 1) {
+            paddr = alloc_pages(1);
+            if (!paddr) {
+                printf("process %d: out of memory\n", current_proc->pid);
+                return false;
+            }
+            memcpy((void *) paddr, (void *) old, PAGE_SIZE);
+            page_put(old);
+        }
+
+        *pte = ((paddr / PAGE_SIZE) << 10) | ((*pte & 0x3ff & ~PAGE_COW) | PAGE_W);
+        flush_tlb_page(current_proc->asid, page);
+        return true;
+    }
+
+    if (pte && (*pte & PAGE_V))
+        return false; // 已经映射了，权限不够
+
+    paddr_t paddr;
+    uint32_t flags = vma->prot | PAGE_U;
+    switch (vma->kind) {
+        case VMA_FILE: {
+            size_t off = vma->offset + (page - vma->start);
+            sleeplock_acquire(&fs_lock);
+            if (!fs_load(vma->file) || off >= vma->file->capacity) {
+                sleeplock_release(&fs_lock);
+                return false;
+            }
+
+            paddr = (paddr_t) vma->file->data + off;
+            if (!vma->shared && (vma->prot & PAGE_W)) { // 私有的可写映射：拷贝一份，写入不影响文件
+                paddr_t copy = alloc_pages(1);
+                if (!copy) {
+                    sleeplock_release(&fs_lock);
+                    printf("process %d: out of memory\n", current_proc->pid);
+                    return false;
+                }
+                memcpy((void *) copy, (void *) paddr, PAGE_SIZE);
+                paddr = copy;
+            } else {
+                flags |= PAGE_NOFREE;  // 文件的物理页，解除映射时不释放
+            }
+            sleeplock_release(&fs_lock);
+            break;
+        }
+        case VMA_IMAGE: {
+            size_t off = page - vma->start;
+            const uint8_t *src = vma->image + off;
+            if (!(vma->prot & PAGE_W) && off + PAGE_SIZE <= vma->filesz
+                && is_aligned((vaddr_t) src, PAGE_SIZE)) {
+                // 只读且整页都是镜像数据：直接映射镜像所在的物理页，不拷贝
+                paddr = (paddr_t) src;
+                flags |= PAGE_NOFREE;
+            } else {
+                // 可写的段或者跨越 filesz 的页：拷贝镜像中的部分，剩下的填零
+                paddr = alloc_pages(1);
+                if (!paddr) {
+                    printf("process %d: out of memory\n", current_proc->pid);
+                    return false;
+                }
+                if (off < vma->filesz) {
+                    size_t n = vma->filesz - off < PAGE_SIZE ? vma->filesz - off : PAGE_SIZE;
+                    memcpy((void *) paddr, src, n);
+                }
+            }
+            break;
+        }
+        default:
+            return false;
+    }
+
+    if (!map_page(current_proc->page_table, page, paddr, flags)) {
+        if (!(flags & PAGE_NOFREE))
+            free_pages(paddr, 1);
+        printf("process %d: out of memory\n", current_proc->pid);
+        return false;
+    }
+    flush_tlb_page(current_proc->asid, page);
+    current_proc->resident_pages++;
+    return true;
+}
+
+/*
+ * user_prefault: 内核访问用户内存前，先把 [addr, addr + len) 中还没映射的页映射好。
+ * 内核态的缺页不能嵌套处理（kernel_entry 只支持从用户态陷入），所以必须提前建立映射。
+ */
+bool user_prefault(vaddr_t addr, size_t len, bool write) {
+    if (len == 0)
+        return true;
+
+    // 先检查范围：addr + len 回绕，或者落在用户区域之外（内核、MMIO）的一律拒绝
+    if (addr + len < addr || addr < USER_BASE || addr + len > MMAP_END)
+        return false;
+
+    for (vaddr_t page = addr & ~(PAGE_SIZE - 1); page < addr + len; page += PAGE_SIZE) {
+        uint32_t *pte = lookup_pte(current_proc->page_table, page);
+        if (pte && (*pte & PAGE_V) && (*pte & PAGE_U) && (!write || (*pte & PAGE_W)))
+            continue;
+
+        if (!handle_page_fault(page, write ? SCAUSE_STORE_PAGE_FAULT : SCAUSE_LOAD_PAGE_FAULT))
+            return false;
+    }
+    return true;
+}
+
+bool user_prefault_str(const char *s) { // 逐页映射以 '\0' 结尾的用户字符串
+    while (1) {
+        if (!user_prefault((vaddr_t) s, 1, false))
+            return false;
+
+        const char *page_end = (const char *) align_up((vaddr_t) s + 1, PAGE_SIZE);
+        for (; s < page_end; s++) {
+            if (*s == '\0')
+                return true;
+        }
+    }
+}
+
+int sys_mmap(int fd, int len, int flags) {
+    struct file_desc *desc = fd_get(fd);
+    if (!desc || len <= 0)
+        return -1;
+
+    struct vma *vma = vma_alloc(current_proc);
+    size_t size = align_up((size_t) len, PAGE_SIZE);
+    if (!vma || current_proc->mmap_next + size > MMAP_END)
+        return -1;
+
+    vma->kind = VMA_FILE;
+    vma->start = current_proc->mmap_next;
+    vma->end = vma->start + size;
+    vma->prot = PAGE_R | (flags & PROT_WRITE ? PAGE_W : 0) | (flags & PROT_EXEC ? PAGE_X : 0);
+    vma->shared = (flags & MAP_SHARED) != 0;
+    vma->file = desc->file;
+    vma->offset = 0;
+    vma->file->map_count++;
+    current_proc->mmap_next += size;
+    return vma->start;
+}
+
+/*
+ * fork_copy_pages: 把 parent 页表中的用户页映射到 child 的页表。
+ * 可写的私有页在两边都改成只读并标记 PAGE_COW，真正的拷贝推迟到写入时的缺页；
+ * 其他页直接共享。FORK_COPY_ALL 时可写页立即拷贝，作为比较的基线。返回拷贝的页数。
+ * 内存不足时返回 -1，已经建立的部分留在 child 的页表中，由调用者释放；父进程中已经改成写时复制的页保持原样。
+ */
+int fork_copy_pages(struct process *parent, struct process *child) {
+    int copied = 0;
+    for (int vpn1 = 0; vpn1 < 1024 && copied >= 0; vpn1++) {
+        if (!(parent->page_table[vpn1] & PAGE_V) || is_kernel_pte(parent->page_table, vpn1))
+            continue;
+
+        uint32_t *table0 = (uint32_t *) ((parent->page_table[vpn1] >> 10) * PAGE_SIZE);
+        uint32_t *child_table0 = (uint32_t *) alloc_pages(1);
+        if (!child_table0) {
+            copied = -1;
+            break;
+        }
+        child->page_table[vpn1] = (((paddr_t) child_table0 / PAGE_SIZE) << 10) | PAGE_V;
+        for (int vpn0 = 0; vpn0 < 1024 && copied >= 0; vpn0++) {
+            uint32_t pte = table0[vpn0];
+            if (!(pte & PAGE_V) || !(pte & PAGE_U))
+                continue;
+
+            if (!(pte & PAGE_NOFREE)) {
+                paddr_t paddr = (pte >> 10) * PAGE_SIZE;
+                if (FORK_COPY_ALL && (pte & (PAGE_W | PAGE_COW))) {
+                    paddr_t copy = alloc_pages(1);
+                    if (!copy) {
+                        copied = -1;
+                        break;
+                    }
+                    memcpy((void *) copy, (void *) paddr, PAGE_SIZE);
+                    child_table0[vpn0] = ((copy / PAGE_SIZE) << 10) | (pte & 0x3ff);
+                    copied++;
+                    continue;
+                }
+
+                page_get(paddr);
+                if (pte & PAGE_W) {
+                    pte = (pte & ~PAGE_W) | PAGE_COW;
+                    table0[vpn0] = pte;
+                }
+            }
+            child_table0[vpn0] = pte;
+        }
+    }
+
+    // 父进程的可写页变成了只读，刷新它的 TLB 表项（失败时也要刷新，已经改过的表项不会恢复）
+    __asm__ __volatile__("sfence.vma zero, %0" :: "r"(parent->asid) : "memory");
+    return copied;
+}
+
+/*
+ * sys_fork: 创建当前进程的副本。子进程共享父进程的页面（写时复制），
+ * 拷贝文件描述符和映射区域，从同一个 ecall 返回，返回值为 0；父进程得到子进程的 pid。
+ */
+int sys_fork(struct trap_frame *f, uint32_t user_pc) {
+    bool free_slot = false;
+    for (int i = 0; i < PROCS_MAX; i++) {
+        if (procs[i].state == PROC_UNUSED)
+            free_slot = true;
+    }
+    if (!free_slot)
+        return -1;
+
+    struct process *child = create_process(NULL, 0);
+    if (!child)
+        return -1;
+    int copied = fork_copy_pages(current_proc, child);
+    if (copied < 0) { // 内存不足：释放子进程已经建立的页表和页面引用，槽位还给进程表
+        free_page_table(child->page_table);
+        child->page_table = NULL;
+        child->state = PROC_UNUSED;
+        return -1;
+    }
+    kstats.fork_pages_copied += copied;
+    kstats.fork_pages += current_proc->resident_pages;
+    memcpy(child->fds, current_proc->fds, sizeof(child->fds));
+    memcpy(child->vmas, current_proc->vmas, sizeof(child->vmas));
+    for (int i = 0; i < VMAS_MAX; i++) {
+        if (child->vmas[i].file)
+            child->vmas[i].file->map_count++;
+    }
+    child->mmap_next = current_proc->mmap_next;
+    child->parent = current_proc;
+    current_proc->children++;
+    child->resident_pages = current_proc->resident_pages;
+    memcpy(child->name, current_proc->name, sizeof(child->name));
+
+    // 子进程的内核栈：栈顶是父进程 trap_frame 的拷贝（a0 改为 0），
+    // 下面是 switch_context 恢复用的寄存器，ra 指向 fork_return，s0 是用户态返回地址。
+    struct trap_frame *child_f = (struct trap_frame *) kernel_stack_top(child) - 1;
+    *child_f = *f;
+    child_f->a0 = 0;
+
+    uint32_t *sp = (uint32_t *) child_f;
+    for (int i = 0; i < 11; i++)
+        *--sp = 0;                        // s11 ~ s1
+    *--sp = user_pc;                      // s0：ecall 的下一条指令
+    *--sp = (uint32_t) fork_return;       // ra
+    child->sp = (uint32_t) sp;
+
+    runq_push(child);
+    return child->pid; // 耗时记在 stats 的 fork 系统调用里
+}
+
+/*
+ * vma_unmap: 解除区域中的所有映射。
+ * 共享映射中被写过（PTE 的 D 位）的页标记为脏，由 fs_flush 写回；属于进程自己的页释放。
+ * 写回失败返回 -1（映射仍然解除）。
+ */
+int vma_unmap(struct vma *vma) {
+    bool dirty = false;
+    for (vaddr_t page = vma->start; page < vma->end; page += PAGE_SIZE) {
+        uint32_t *pte = lookup_pte(current_proc->page_table, page);
+        if (!pte || !(*pte & PAGE_V))
+            continue;
+
+        size_t off = vma->offset + (page - vma->start);
+        if (vma->kind == VMA_FILE && vma->shared && (*pte & PAGE_D)) {
+            sleeplock_acquire(&fs_lock); // fs_flush 可能正在写回这个文件
+            fs_mark_dirty(vma->file, off, off + PAGE_SIZE);
+            sleeplock_release(&fs_lock);
+            dirty = true;
+        }
+
+        if (!(*pte & PAGE_NOFREE))
+            page_put((*pte >> 10) * PAGE_SIZE);
+
+        *pte = 0;
+        flush_tlb_page(current_proc->asid, page);
+    }
+
+    if (vma->file)
+        vma->file->map_count--;
+    vma->kind = 0;
+    vma->file = NULL;
+    return dirty ? fs_flush() : 0;
+}
+
+int sys_munmap(vaddr_t addr) {
+    for (int i = 0; i < VMAS_MAX; i++) {
+        struct vma *vma = &current_proc->vmas[i];
+        if (vma->kind == VMA_FILE && vma->start == addr)
+            return vma_unmap(vma);
+    }
+    return -1;
+}
+
+struct program programs[] = {
+    { "shell", (const uint8_t *) _binary_shell_elf_start, (size_t) _binary_shell_elf_size },
+};
+
+/*
+ * sys_exec: 用 name 指定的程序替换当前进程的地址空间。
+ * 先在内嵌的程序表中查找，再从文件系统中查找；镜像经过检查之后才拆除旧的地址空间。
+ * 一级页表和内核栈原地复用，只释放用户页面，最后整体刷新一次该 ASID 的 TLB。
+ * 成功时不返回到原来的程序：f 被清零，*user_pc 改为新程序的入口地址。
+ */
+int sys_exec(struct trap_frame *f, uint32_t *user_pc) {
+    char name[sizeof(((struct file *) 0)->name)];
+    const char *path = (const char *) f->a0;
+    if (!user_prefault_str(path))
+        return -1;
+
+    size_t len = 0;
+    while (path[len] && len < sizeof(name) - 1) {
+        name[len] = path[len];
+        len++;
+    }
+    name[len] = '\0';
+
+    const uint8_t *image = NULL;
+    size_t image_size = 0;
+    struct file *file = NULL;
+    for (size_t i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+        if (strcmp(programs[i].name, name) == 0) {
+            image = programs[i].image;
+            image_size = programs[i].size;
+        }
+    }
+
+    if (!image) {
+        sleeplock_acquire(&fs_lock);
+        file = fs_lookup(name);
+        if (file && !fs_load(file))
+            file = NULL;
+        if (file) {
+            image = file->data;
+            image_size = file->size;
+            file->map_count++; // 拆除旧地址空间时可能让出 CPU，期间不允许重新分配文件数据
+        }
+        sleeplock_release(&fs_lock);
+    }
+
+    if (!elf_check(image, image_size)) {
+        if (file)
+            file->map_count--;
+        return -1;
+    }
+
+    // 拆除旧的地址空间：文件映射要处理脏页，其余区域和页面直接整体释放
+    for (int i = 0; i < VMAS_MAX; i++) {
+        struct vma *vma = &current_proc->vmas[i];
+        if (vma->kind == VMA_FILE)
+            vma_unmap(vma);
+        else if (vma->file)
+            vma->file->map_count--;
+    }
+    memset(current_proc->vmas, 0, sizeof(current_proc->vmas));
+    free_user_pages(current_proc->page_table);
+    __asm__ __volatile__("sfence.vma zero, %0" :: "r"(current_proc->asid) : "memory");
+    current_proc->mmap_next = MMAP_BASE;
+    current_proc->resident_pages = 0;
+
+    *user_pc = elf_load(current_proc, image, file);
+    if (file)
+        file->map_count--;
+
+    memcpy(current_proc->name, name, PROC_NAME_MAX - 1);
+    current_proc->name[PROC_NAME_MAX - 1] = '\0';
+
+    memset(f, 0, sizeof(*f)); // 新程序从干净的寄存器开始，栈指针由它的 start 设置
+    return 0;
+}
+
+/*
+ * proc_exit: 结束当前进程。关闭文件、解除映射后切换到其他进程，页表和用户页面在 yield 中回收。
+ */
+__attribute__((noreturn)) void proc_exit(void) {
+    for (int fd = 0; fd < FDS_MAX; fd++) {
+        if (current_proc->fds[fd].file)
+            fd_close(&current_proc->fds[fd]);
+    }
+
+    for (int i = 0; i < VMAS_MAX; i++) {
+        if (current_proc->vmas[i].kind)
+            vma_unmap(&current_proc->vmas[i]);
+    }
+
+    for (int i = 0; i < PROCS_MAX; i++) { // 子进程不再有父进程
+        if (procs[i].parent == current_proc)
+            procs[i].parent = NULL;
+    }
+
+    struct process *parent = current_proc->parent;
+    if (parent) {
+        parent->children--;
+        parent->exited_children++;
+        wake_up(&parent->child_wait);
+    }
+
+    printf("process %d exited (%d resident pages)\n", current_proc->pid,
+           current_proc->resident_pages);
+    current_proc->state = PROC_EXITED;
+    yield();
+    PANIC("unreachable");
+}
+
+int sys_wait(void) { // 等待一个子进程退出，没有子进程时返回 -1
+    while (!current_proc->exited_children) {
+        if (!current_proc->children)
+            return -1;
+        sleep_on(&current_proc->child_wait);
+    }
+
+    current_proc->exited_children--;
+    return 0;
+}
+
+/*
+ * trace_drain: 把一个 hart 的跟踪环中还没导出的记录按时间顺序拷贝到 out，返回条数。
+ * 所属的 hart 可能同时在写（它在拿大内核锁之前也会记录），拷贝之后重新读 head，
+ * 丢掉拷贝期间可能被覆盖的最老的记录。
+ */
+uint32_t trace_drain(struct trace_ring *ring, struct trace_record *out) {
+    uint32_t head = ring->head;
+    __sync_synchronize();
+    uint32_t start = head - ring->tail > TRACE_ENTRIES ? head - TRACE_ENTRIES : ring->tail;
+    uint32_t n = head - start;
+    for (uint32_t i = 0; i < n; i++)
+        out[i] = ring->records[(start + i) % TRACE_ENTRIES];
+
+    __sync_synchronize();
+    uint32_t now = ring->head;
+    uint32_t skip = 0;
+    if (now - start >= TRACE_ENTRIES)  // 序号 now 的记录正在写入序号 now - TRACE_ENTRIES 的位置
+        skip = now - start - TRACE_ENTRIES + 1;
+    if (skip > n)
+        skip = n;
+    for (uint32_t i = skip; i < n; i++)
+        out[i - skip] = out[i];
+
+    ring->tail = head;
+    return n - skip;
+}
+
+size_t trace_fill(uint8_t *data) { // 把所有 hart 的跟踪记录写成跟踪文件的格式
+    // 拷贝期间不会睡眠，其他 hart 拿不到大内核锁，不会同时导出同一批记录
+    struct trace_header *header = (struct trace_header *) data;
+    struct trace_record *records = (struct trace_record *) (header + 1);
+    uint32_t count = 0;
+    for (int i = 0; i < ncpus; i++)
+        count += trace_drain(&cpus[i].trace, &records[count]);
+
+    header->magic = TRACE_MAGIC;
+    header->timer_freq = TIMER_FREQ;
+    header->count = count;
+    header->record_size = sizeof(struct trace_record);
+    return sizeof(*header) + count * sizeof(struct trace_record);
+}
+
+/*
+ * sys_trace_dump: 把所有 hart 的跟踪记录导出到文件并写回磁盘，返回记录条数。
+ * 每条记录只导出一次，下一次导出从这次的末尾开始。文件名必须已经存在于 tar 文件系统中。
+ */
+int sys_trace_dump(const char *filename) {
+    size_t max = sizeof(struct trace_header) + ncpus * TRACE_ENTRIES * sizeof(struct trace_record);
+    int size = fs_replace(filename, max, trace_fill);
+    if (size < 0)
+        return -1;
+    return (size - sizeof(struct trace_header)) / sizeof(struct trace_record);
+}
+
+size_t profile_fill(uint8_t *data) { // 把所有 hart 的 PC 直方图中用到的表项写成剖析文件的格式
+    struct profile_header *header = (struct profile_header *) data;
+    struct profile_entry *entries = (struct profile_entry *) (header + 1);
+    uint32_t count = 0, dropped = 0;
+    for (int i = 0; i < ncpus; i++) {
+        for (int j = 0; j < PROFILE_ENTRIES; j++) {
+            if (cpus[i].profile[j].count)
+                entries[count++] = cpus[i].profile[j];
+        }
+        dropped += cpus[i].profile_dropped;
+    }
+
+    header->magic = PROFILE_MAGIC;
+    header->freq = PROFILE_FREQ;
+    header->count = count;
+    header->entry_size = sizeof(struct profile_entry);
+    header->dropped = dropped;
+    return sizeof(*header) + count * sizeof(struct profile_entry);
+}
+
+/*
+ * sys_profile: 控制采样剖析。PROFILE_START 清空直方图并开始采样，PROFILE_STOP 停止，
+ * PROFILE_DUMP 停止后把直方图导出到文件并返回表项数。
+ * 调用的 hart 立即开始采样，其他 hart 在下一次设置定时器时（最多一个时间片之后）开始。
+ */
+int sys_profile(int op, const char *filename) {
+    switch (op) {
+        case PROFILE_START:
+            profile_running = false;
+            for (int i = 0; i < ncpus; i++) {
+                memset(cpus[i].profile, 0, sizeof(cpus[i].profile));
+                cpus[i].profile_dropped = 0;
+                cpus[i].profile_next = 0;
+            }
+            profile_running = true;
+            timer_set(this_cpu()->timer_deadline);
+            return 0;
+        case PROFILE_STOP:
+            profile_running = false;
+            return 0;
+        case PROFILE_DUMP: {
+            profile_running = false;
+            size_t max = sizeof(struct profile_header) + ncpus * PROFILE_ENTRIES * sizeof(struct profile_entry);
+            int size = fs_replace(filename, max, profile_fill);
+            if (size < 0)
+                return -1;
+            return (size - sizeof(struct profile_header)) / sizeof(struct profile_entry);
+        }
+        default:
+            return -1;
+    }
+}
+
+/*
+ * console_write_user: 把用户缓冲区输出到控制台。缓冲区已经映射好，
+ * 逐页把虚拟地址转换成物理地址后直接交给 console_write，不需要拷贝。
+ */
+int console_write_user(vaddr_t buf, int len) {
+    for (int done = 0; done < len;) {
+        vaddr_t vaddr = buf + done;
+        uint32_t *pte = lookup_pte(current_proc->page_table, vaddr);
+        size_t n = PAGE_SIZE - vaddr % PAGE_SIZE;
+        if (n > (size_t) (len - done))
+            n = len - done;
+
+        console_write((const char *) ((*pte >> 10) * PAGE_SIZE + vaddr % PAGE_SIZE), n);
+        done += n;
+    }
+    return len;
+}
+
 /*
  * handle_syscall: 系统调用处理函数，用于处理用户程序发的系统调用请求。
  * 根据不同的类型，处理不同的系统调用
  * trap_frame 与用户程序进行参数传递、状态更新
+ * user_pc 是系统调用返回后继续执行的地址
 */
 
-void handle_syscall(struct trap_frame *f) {   // 入参：保存了系统调用的参数和上下文信息（上下文信息其实就是寄存器状态）
+void handle_syscall(struct trap_frame *f, uint32_t *user_pc) {   // 入参：保存了系统调用的参数和上下文信息（上下文信息其实就是寄存器状态）
     switch (f->a3) {         // 根据系统调用类型进行分支处理
         case SYS_PUTCHAR:
             putchar(f->a0);
             break;
-        case SYS_GETCHAR:
-            while (1) {
-                long ch = getchar();
-                if (ch >= 0) {
-                    f->a0 = ch;
-                    break;
-                }
-
-                yield();  // 进程切换
-            }
+        case SYS_GETCHAR: {
+            char ch;
+            tty_read(&ch, 1);  // 按行缓冲：没有已提交的行时睡眠，由串口中断在回车后唤醒
+            f->a0 = ch;
             break;
+        }
         case SYS_EXIT:
-            printf("process %d exited\n", current_proc->pid);
-            current_proc->state = PROC_EXITED;
+            proc_exit();
+        case SYS_WAIT:
+            f->a0 = sys_wait();
+            break;
+        case SYS_GETPID:
+            f->a0 = current_proc->pid;
+            break;
+        case SYS_YIELD:
             yield();
-            PANIC("unreachable");
+            break;
+        case SYS_SLEEP:
+            if ((int) f->a0 > 0)
+                sleep_until(read_time() + (uint64_t) f->a0 * (TIMER_FREQ / 1000));
+            break;
         case SYS_READFILE:
         case SYS_WRITEFILE: {
             const char *filename = (const char *) f->a0;
             char *buf = (char *) f->a1;
             int len = f->a2;
+            if (!user_prefault_str(filename) || len < 0
+                || !user_prefault((vaddr_t) buf, len, f->a3 == SYS_READFILE)) {
+                f->a0 = -1;
+                break;
+            }
+
             struct file *file = fs_lookup(filename);
             if (!file) {
                 printf("file not found: %s\n", filename);
@@ -547,67 +2553,374 @@ void handle_syscall(struct trap_frame *f) {   // 入参：保存了系统调用
                 break;
             }
 
-            if (len > (int) sizeof(file->data))
-                len = file->size;
-
+            sleeplock_acquire(&fs_lock);
             if (f->a3 == SYS_WRITEFILE) {
+                if (!fs_reserve(file, len)) {
+                    sleeplock_release(&fs_lock);
+                    f->a0 = -1;
+                    break;
+                }
+                // 整个文件被覆盖，不需要先加载原来的内容；失败时不能设置，否则会留下没有数据的“已加载”文件
+                file->loaded = true;
+
                 memcpy(file->data, buf, len);
+                fs_clear_tail(file, len);
+                if (file->size != (size_t) len)
+                    file->header_dirty = true;
                 file->size = len;
-                fs_flush();
+                fs_mark_dirty(file, 0, len);
+            } else if (!fs_load(file)) {
+                len = -1;
             } else {
+                if (len > (int) file->size)
+                    len = file->size;
                 memcpy(buf, file->data, len);
             }
+            sleeplock_release(&fs_lock);
+
+            if (f->a3 == SYS_WRITEFILE && fs_flush() < 0)
+                len = -1;
 
             f->a0 = len;
             break;
         }
+        case SYS_OPEN:
+            if (!user_prefault_str((const char *) f->a0)) {
+                f->a0 = -1;
+                break;
+            }
+            f->a0 = fd_open((const char *) f->a0);
+            break;
+        case SYS_MMAP:
+            f->a0 = sys_mmap(f->a0, f->a1, f->a2);
+            break;
+        case SYS_MUNMAP:
+            f->a0 = sys_munmap(f->a0);
+            break;
+        case SYS_FORK:
+            f->a0 = sys_fork(f, *user_pc);
+            break;
+        case SYS_EXEC:
+            if (sys_exec(f, user_pc) < 0)
+                f->a0 = -1;
+            break;
+        case SYS_READ:
+        case SYS_WRITE:
+        case SYS_LSEEK:
+        case SYS_CLOSE: {
+            if (f->a3 == SYS_READ && f->a0 == STDIN_FILENO) {
+                if ((int) f->a2 < 0 || !user_prefault(f->a1, f->a2, true))
+                    f->a0 = -1;
+                else
+                    f->a0 = f->a2 ? tty_read((char *) f->a1, f->a2) : 0;
+                break;
+            }
+
+            if (f->a3 == SYS_WRITE && (f->a0 == STDOUT_FILENO || f->a0 == STDERR_FILENO)) {
+                if ((int) f->a2 < 0 || !user_prefault(f->a1, f->a2, false))
+                    f->a0 = -1;
+                else
+                    f->a0 = console_write_user(f->a1, f->a2);
+                break;
+            }
+
+            struct file_desc *desc = fd_get(f->a0);
+            if (!desc) {
+                f->a0 = -1;
+                break;
+            }
+
+            if ((f->a3 == SYS_READ || f->a3 == SYS_WRITE)
+                && !user_prefault(f->a1, f->a2, f->a3 == SYS_READ)) {
+                f->a0 = -1;
+                break;
+            }
+
+            if (f->a3 == SYS_READ)
+                f->a0 = fd_read(desc, (char *) f->a1, f->a2);
+            else if (f->a3 == SYS_WRITE)
+                f->a0 = fd_write(desc, (const char *) f->a1, f->a2);
+            else if (f->a3 == SYS_LSEEK)
+                f->a0 = fd_lseek(desc, f->a1, f->a2);
+            else
+                f->a0 = fd_close(desc);
+            break;
+        }
+        case SYS_STATS: // 把计数器复制到用户缓冲区，返回复制的字节数
+            if (f->a1 < sizeof(kstats) || !user_prefault(f->a0, sizeof(kstats), true)) {
+                f->a0 = -1;
+                break;
+            }
+            kstats.pages_free = free_page_count;
+            memcpy((void *) f->a0, &kstats, sizeof(kstats));
+            if (f->a2 & STATS_RESET)
+                memset(&kstats, 0, sizeof(kstats));
+            f->a0 = sizeof(kstats);
+            break;
+        case SYS_TRACE:
+            if (!user_prefault_str((const char *) f->a0)) {
+                f->a0 = -1;
+                break;
+            }
+            f->a0 = sys_trace_dump((const char *) f->a0);
+            break;
+        case SYS_PROFILE:
+            if (f->a0 == PROFILE_DUMP && !user_prefault_str((const char *) f->a1)) {
+                f->a0 = -1;
+                break;
+            }
+            f->a0 = sys_profile(f->a0, (const char *) f->a1);
+            break;
         default:
             PANIC("unexpected syscall a3=%x\n", f->a3);
     }
 }
 
+void plic_init(void) { // 只把 virtio-blk 和串口的中断转发给启动 hart 的监管者模式
+    uint32_t hart = cpus[0].hartid;
+    *(volatile uint32_t *) PLIC_PRIORITY(VIRTIO_BLK_IRQ) = 1;
+    *(volatile uint32_t *) PLIC_PRIORITY(UART_IRQ) = 1;
+    *(volatile uint32_t *) PLIC_SENABLE(hart) = (1 << VIRTIO_BLK_IRQ) | (1 << UART_IRQ);
+    *(volatile uint32_t *) PLIC_STHRESHOLD(hart) = 0;
+}
+
+void handle_external_irq(void) { // 从 PLIC 领取中断，交给对应的设备处理，最后通知 PLIC 处理完成
+    uint32_t hart = cpus[0].hartid;
+    uint32_t irq = *(volatile uint32_t *) PLIC_SCLAIM(hart);
+    switch (irq) {
+        case 0: // 已经被处理过了
+            return;
+        case VIRTIO_BLK_IRQ:
+            virtio_blk_handle_irq();
+            break;
+        case UART_IRQ:
+            uart_handle_irq();
+            break;
+        default:
+            printf("unexpected external irq=%d\n", irq);
+    }
+
+    *(volatile uint32_t *) PLIC_SCLAIM(hart) = irq;
+}
+
+void stat_record(struct latency_stat *stat, uint32_t ticks) { // 记录一次耗时：次数、总和、最小、最大和 log2 直方图
+    if (stat->count == 0 || ticks < stat->min)
+        stat->min = ticks;
+    if (ticks > stat->max)
+        stat->max = ticks;
+    stat->count++;
+    stat->total += ticks;
+
+    int bucket = 0;
+    while (bucket < STATS_BUCKETS - 1 && (ticks >> (bucket + 1)))
+        bucket++;
+    stat->hist[bucket]++;
+}
+
+/*
+ * handle_interrupt: 按中断原因分发中断。
+ * 内核态下 sstatus.SIE 为 0，所以中断只会在用户态发生（或者由空闲进程主动处理），这里可以直接切换进程。
+ */
+void handle_interrupt(uint32_t irq) { // 中断处理的耗时在 yield 之前记录，不包括被抢占的进程等待的时间
+    uint32_t start = READ_TIME();
+    switch (irq) {
+        case IRQ_S_SOFT: // 其他 hart 发来的 IPI：有新的就绪进程，重新调度
+            __asm__ __volatile__("csrc sip, %0" :: "r"(SIE_SSIE));
+            break;
+        case IRQ_S_TIMER:  // 时间片用完或者有进程睡眠结束：唤醒到期的进程，设置下一个时间片，抢占当前进程
+            timer_expire();
+            timer_arm();
+            break;
+        case IRQ_S_EXTERNAL: // 设备中断：处理后立即调度，让被唤醒的进程尽快继续 I/O
+            handle_external_irq();
+            break;
+        default:
+            PANIC("unexpected interrupt irq=%d", irq);
+    }
+    stat_record(&kstats.interrupts, READ_TIME() - start);
+    yield(); // 都要重新调度：IPI 带来了新的就绪进程，时间片用完，或者设备中断唤醒了等待 I/O 的进程
+}
+
 /*
- * handle_trap：处理来自于用户程序的异常，或者是系统调用
- *
+ * handle_trap：处理来自于用户程序的中断、异常，或者是系统调用
+ * 耗时用 time 计数器而不是 cycle 计数器：阻塞的系统调用可能在另一个 hart 上返回，各个 hart 的 cycle 计数器互不相关。
+ * 计时从拿锁之前开始，所以等待大内核锁的时间也算在里面；阻塞的系统调用包括睡眠的时间。
+ * 中断的耗时在 handle_interrupt 里记录。
  */
 void handle_trap(struct trap_frame *f) {  // 入参是异常发生时的内存上下文
+    uint32_t start = READ_TIME();
     uint32_t scause = READ_CSR(scause);   // 从控制和状态寄存器 scause 中获取走到这个函数的原因。
     uint32_t stval = READ_CSR(stval);     // 获取异常时的无效地址或者其他相关值。
     uint32_t user_pc = READ_CSR(sepc);    // 获取异常时的程序计数器。
-    if (scause == SCAUSE_ECALL) {         // 如果是系统调用，那么处理系统调用，并且程序计数器往下走。以便系统调用处理完，程序继续往下走
-        handle_syscall(f);
+    uint32_t sstatus = READ_CSR(sstatus); // 剖析时拿到锁之后可能被采样中断打断，陷入相关的 CSR 要在这之前读出
+    trace(TRACE_TRAP_ENTER, scause, scause == SCAUSE_ECALL ? f->a3 : stval);
+    // 采样和重设定时器只访问本 hart 的数据，必须在拿锁之前做：剖析时拿锁会打开 SIE，
+    // 挂起的定时器中断会立刻陷入 profile_entry，用户态的样本就被记到内核上了
+    bool sample_only = scause == (SCAUSE_INTERRUPT | IRQ_S_TIMER) && profile_tick(user_pc, true);
+    kernel_lock_acquire();                 // 返回用户态前在 trap_return 中释放
+    if (sample_only) {
+        // 只是剖析的采样中断，时间片还没用完，直接回到用户态
+    } else if (scause & SCAUSE_INTERRUPT) { // 中断：处理完后回到被打断的指令继续执行
+        handle_interrupt(scause & ~SCAUSE_INTERRUPT);
+    } else if (scause == SCAUSE_ECALL) {  // 如果是系统调用，那么处理系统调用，并且程序计数器往下走。以便系统调用处理完，程序继续往下走
+        uint32_t sysno = f->a3;            // exec 成功后 f 被清零，先记下系统调用号
         user_pc += 4;
+        handle_syscall(f, &user_pc);          // exec 会把返回地址改成新程序的入口
+        if (sysno < STATS_SYSCALLS)
+            stat_record(&kstats.syscalls[sysno], READ_TIME() - start);
+    } else if ((scause == SCAUSE_INST_PAGE_FAULT || scause == SCAUSE_LOAD_PAGE_FAULT
+                || scause == SCAUSE_STORE_PAGE_FAULT) && !(sstatus & SSTATUS_SPP)) {
+        // 用户态缺页：按需建立映射后重新执行该指令；非法访问则结束进程
+        if (!handle_page_fault(stval, scause)) {
+            printf("process %d: segmentation fault at %x (sepc=%x)\n",
+                   current_proc->pid, stval, user_pc);
+            proc_exit();
+        }
+        stat_record(&kstats.page_faults, READ_TIME() - start);
     } else {                              // 否则，调用 PNANIC 打印错误信息并终止程序。
         PANIC("unexpected trap scause=%x, stval=%x, sepc=%x\n", scause, stval, user_pc);
     }
 
+    profile_kernel_off();
     WRITE_CSR(sepc, user_pc);            // 更新程序计数器，以便异常处理完，继续执行
+    trace(TRACE_TRAP_EXIT, scause, scause == SCAUSE_ECALL ? f->a0 : 0);
 }
 
-void kernel_main(void) {
+void cpu_init(struct cpu *cpu, uint32_t hartid) { // 为一个 hart 创建空闲进程，空闲进程就是它当前运行的进程
+    cpu->hartid = hartid;
+    cpu->idle = create_process(NULL, 0);
+    if (!cpu->idle)
+        PANIC("out of memory");
+    cpu->idle->pid = -1; // idle
+    strcpy(cpu->idle->name, "idle");
+    cpu->idle->cpu = cpu;
+    cpu->current = cpu->idle;
+    cpu->asid_generation = asid_generation;
+}
+
+/*
+ * idle_loop: 空闲进程。没有可运行的进程（包括可以从其他 hart 偷来的进程）时会切换到这里。
+ * 内核态 sstatus.SIE 为 0，中断不会陷入，但 wfi 仍会在 sie 中使能的中断到来时返回，
+ * 这里手动处理挂起的中断，然后重新调度。
+ * 空闲时不需要时间片，定时器只在最早的睡眠进程醒来时触发，没有睡眠进程就关闭。
+ * wfi 期间释放大内核锁；其他 hart 放入新的就绪进程时看到 waiting，用 IPI 叫醒这里。
+ */
+__attribute__((noreturn)) void idle_loop(void) {
+    for (;;) {
+        yield();
+        struct cpu *cpu = this_cpu();
+        timer_set(timer_head ? timer_head->wake_time : TIMER_NEVER);
+        cpu->waiting = true;
+        kernel_lock_release();
+        __asm__ __volatile__("wfi");
+        kernel_lock_acquire();
+        cpu->waiting = false;
+
+        uint32_t pending = READ_CSR(sip) & READ_CSR(sie);
+        if (pending & SIE_SSIE)
+            __asm__ __volatile__("csrc sip, %0" :: "r"(SIE_SSIE));
+        if (pending & (1 << IRQ_S_EXTERNAL))
+            handle_interrupt(IRQ_S_EXTERNAL);
+        if (pending & (1 << IRQ_S_TIMER))
+            handle_interrupt(IRQ_S_TIMER);
+    }
+}
+
+__attribute__((naked)) void secondary_boot(void) { // 其他 hart 的入口：a1 是空闲进程的内核栈顶，那里存着 struct cpu
+    __asm__ __volatile__(
+        "mv sp, a1\n"
+        "lw tp, 0(sp)\n"
+        "j secondary_main\n"
+    );
+}
+
+__attribute__((noreturn)) void secondary_main(void) {
+    WRITE_CSR(stvec, (uint32_t) kernel_entry);
+    WRITE_CSR(scounteren, SCOUNTEREN_CY | SCOUNTEREN_TM | SCOUNTEREN_IR);
+    WRITE_CSR(satp, SATP_SV32 | ((uint32_t) kernel_page_table / PAGE_SIZE));
+    __asm__ __volatile__("sfence.vma");
+    WRITE_CSR(sie, READ_CSR(sie) | SIE_SSIE | SIE_STIE); // 外部中断只交给启动 hart
+
+    kernel_lock_acquire();
+    printf("hart %d started\n", this_cpu()->hartid);
+    idle_loop();
+}
+
+/*
+ * smp_init: 用 SBI HSM 扩展启动其他处于停止状态的 hart，最多 HARTS_MAX 个。
+ * 每个 hart 以自己空闲进程的内核栈作为启动栈，栈顶保留的字里放着它的 struct cpu。
+ */
+void smp_init(void) {
+    for (uint32_t hartid = 0; ncpus < HARTS_MAX; hartid++) {
+        if (hartid == cpus[0].hartid)
+            continue;
+
+        struct sbiret ret = sbi_call(hartid, 0, 0, 0, 0, 0, SBI_HSM_HART_STATUS, SBI_EXT_HSM);
+        if (ret.error) // 没有更多的 hart 了
+            break;
+        if (ret.value != SBI_HSM_STOPPED)
+            continue;
+
+        struct cpu *cpu = &cpus[ncpus];
+        cpu_init(cpu, hartid);
+        uint32_t *stack_top = kernel_stack_top(cpu->idle);
+        *stack_top = (uint32_t) cpu;
+        ret = sbi_call(hartid, (uint32_t) secondary_boot, (uint32_t) stack_top, 0, 0, 0,
+                       SBI_HSM_HART_START, SBI_EXT_HSM);
+        if (ret.error) {
+            printf("failed to start hart %d: %d\n", hartid, ret.error);
+            cpu->idle->state = PROC_UNUSED;
+            continue;
+        }
+        ncpus++;
+    }
+}
+
+void kernel_main(uint32_t hartid) { // hartid 是 SBI 传来的启动 hart 的编号
     memset(__bss, 0, (size_t) __bss_end - (size_t) __bss); // _bss是未初始化数据，将其清零（包括未初始化的全局变量、静态全局变量、静态局部变量）
+    __asm__ __volatile__("mv tp, %0" :: "r"(&cpus[0]));     // 内核态的 tp 指向当前 hart 的 struct cpu
+    ncpus = 1;
+    cpus[0].hartid = hartid;
+    kernel_lock_acquire();                                 // 启动过程中持有大内核锁，直到第一次返回用户态
+    console_init();                                        // 探测 SBI 是否支持整段输出
     printf("\n\n");
     WRITE_CSR(stvec, (uint32_t) kernel_entry);             // stvec是中断寄存器，将kernel_entry的地址写入stvec，确保当中断发生时，kernel_entry响应和处理这些中断。
+    WRITE_CSR(scounteren, SCOUNTEREN_CY | SCOUNTEREN_TM | SCOUNTEREN_IR); // 用户程序可以用 rdcycle 等指令测量性能
+    page_init();                                           // 初始化物理页分配器
+    if (MEMBENCH) {
+        paddr_t buf = alloc_pages(4);
+        mem_bench((void *) buf, (void *) (buf + 2 * PAGE_SIZE), PAGE_SIZE);
+        free_pages(buf, 4);
+    }
+    kernel_vm_init();                                      // 构建所有进程共享的内核地址空间
+    asid_init();                                           // 探测 ASID 位数
     virtio_blk_init();                                     // 初始化 Virtio 块设备驱动，通常用于管理虚拟磁盘或块设备的操作
     fs_init();                                             // 初始化文件系统
 
-    idle_proc = create_process(NULL, 0);                   // 创建一个空闲进程
-    idle_proc->pid = -1; // idle
-    current_proc = idle_proc;
+    cpu_init(&cpus[0], hartid);                            // 启动 hart 的空闲进程（使用启动栈运行）
 
-    create_process(_binary_shell_bin_start, (size_t) _binary_shell_bin_size);  // 创建新进程，加载 shell 程序
-    yield();         // 进程切换，调度新创建的 shell 进程
-
-    PANIC("switched to idle process");
+    uint64_t spawn_start = read_time();
+    struct process *shell = create_process(_binary_shell_elf_start, (size_t) _binary_shell_elf_size);  // 创建新进程，加载 shell 程序
+    if (!shell)
+        PANIC("out of memory");
+    strcpy(shell->name, "shell");
+    boot_shell = shell;
+    printf("shell: spawned in %d us\n",
+           (uint32_t) (read_time() - spawn_start) / (TIMER_FREQ / 1000000));
+
+    uart_init();
+    plic_init();
+    WRITE_CSR(sie, READ_CSR(sie) | SIE_SSIE | SIE_STIE | SIE_SEIE); // 开启软件、定时器和外部中断（只会在用户态触发）
+    smp_init();
+    printf("smp: %d harts\n", ncpus);
+    idle_loop();     // 调度新创建的 shell 进程，之后作为空闲进程运行
 }
 
 __attribute__((section(".text.boot"))) // 将入口函数boot放在.text.boot中，放在启动时的位置。
 __attribute__((naked)) // 不生成函数入口代码和函数出口代码。boot函数需要手动控制函数进入和退出
 void boot(void) {
     __asm__ __volatile__(
-        "mv sp, %[stack_top]\n" // 内联汇编，将栈顶设置为kernel.ld中的栈顶位置
-        "j kernel_main\n"   // 跳转到kernel_main函数
-        :
-        : [stack_top] "r" (__stack_top) // __stack_top 是kernel.ld中分配好的位置。
+        "la sp, __stack_top\n" // 内联汇编，将栈顶设置为kernel.ld中的栈顶位置（不能经过其他寄存器，a0 是 hartid）
+        "j kernel_main\n"      // 跳转到kernel_main函数，a0 原样传过去
     );
 }
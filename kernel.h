@@ -1,22 +1,72 @@
 #pragma once
 #include "common.h"
 
-#define PROCS_MAX 8       // 最多 8 个线程同时运行
+#define PROCS_MAX 16      // 最多 16 个进程（包括每个 hart 的空闲进程）
+#define HARTS_MAX 4       // 最多使用 4 个 hart
 #define PROC_UNUSED   0   // 进程状态：未使用，可用
 #define PROC_RUNNABLE 1   // 进程状态：可用，可以被调度运行，正在等待
 #define PROC_EXITED   2   // 进程状态：已退出，进程已结束并释放内存
+#define PROC_BLOCKED  3   // 进程状态：在等待队列上睡眠，被唤醒后才能调度
+#define FDS_MAX   16      // 每个进程最多打开的文件数
+#define FD_FIRST  3       // 0~2 预留给标准输入、输出、错误
+#define VMAS_MAX  16      // 每个进程最多的按需映射区域数
+#define VMA_FILE  1       // 映射区域类型：文件（mmap）
+#define VMA_IMAGE 2       // 映射区域类型：可执行文件的段，filesz 之后的部分填零（bss、栈）
+#define MMAP_BASE 0x20000000 // mmap 区域的起始虚拟地址
+#define MMAP_END  0x40000000
 #define SATP_SV32 (1u << 31)
+#define SATP_ASID_SHIFT 22     // satp 中 ASID 字段的位置（Sv32 下 ASID 共 9 位）
+#define SATP_ASID_MASK  0x1ff
+#define TLB_FLUSH_ALL   0      // 设为 1 时每次切换进程都刷新整个 TLB（与 ASID 比较用的基线，用 ctxbench 测量）
+#define SSTATUS_SIE  (1 << 1)       // 监管者模式下允许中断
 #define SSTATUS_SPIE (1 << 5)
 #define SSTATUS_SUM  (1 << 18)
+#define SCOUNTEREN_CY (1 << 0) // 允许用户态读取 cycle
+#define SCOUNTEREN_TM (1 << 1) // 允许用户态读取 time
+#define SCOUNTEREN_IR (1 << 2) // 允许用户态读取 instret
 #define SCAUSE_ECALL 8
+#define SCAUSE_INST_PAGE_FAULT  12
+#define SCAUSE_LOAD_PAGE_FAULT  13
+#define SCAUSE_STORE_PAGE_FAULT 15
+#define SSTATUS_SPP  (1 << 8)       // 陷入前是否处于监管者模式
+#define SCAUSE_INTERRUPT (1u << 31) // scause 最高位为 1 表示中断，否则是异常
+#define IRQ_S_SOFT  1               // 监管者模式软件中断（来自其他 hart 的 IPI）
+#define IRQ_S_TIMER 5               // 监管者模式定时器中断
+#define IRQ_S_EXTERNAL 9            // 监管者模式外部中断（来自 PLIC）
+#define SIE_SSIE (1 << 1)           // sie 中的软件中断使能位
+#define SIE_STIE (1 << 5)           // sie 中的定时器中断使能位
+#define SIE_SEIE (1 << 9)           // sie 中的外部中断使能位
+#define SBI_EXT_TIME  0x54494d45    // SBI TIME 扩展 ("TIME")
+#define SBI_EXT_IPI   0x735049      // SBI IPI 扩展 ("sPI")
+#define SBI_EXT_HSM   0x48534d      // SBI Hart State Management 扩展 ("HSM")
+#define SBI_HSM_HART_START  0       // 启动一个 hart
+#define SBI_HSM_HART_STATUS 2       // 查询 hart 的状态
+#define SBI_HSM_STOPPED     1       // hart 处于停止状态，可以启动
+#define SBI_EXT_BASE  0x10          // SBI Base 扩展
+#define SBI_BASE_PROBE_EXT 3        // 查询某个扩展是否可用
+#define SBI_EXT_DBCN  0x4442434e    // SBI Debug Console 扩展 ("DBCN")
+#define SBI_DBCN_WRITE 0            // console_write：一次输出一段物理内存中的字符
+#define TIMER_FREQ    10000000      // QEMU virt 机器 time CSR 的频率：10MHz
+#define TIME_SLICE_MS 10            // 时间片长度（毫秒），每个时间片结束时抢占当前进程
+#define TIMER_NEVER   ((uint64_t) -1) // 没有需要定时的事件：关闭定时器
 #define PAGE_V    (1 << 0)  // 页有效 （内存页的权限和状态）
 #define PAGE_R    (1 << 1)  // 页可被读取
 #define PAGE_W    (1 << 2)  // 页可被写入
 #define PAGE_X    (1 << 3)  // 页可被执行
 #define PAGE_U    (1 << 4)  // 页可被用户模式程序访问
+#define PAGE_G    (1 << 5)  // 全局映射，对所有 ASID 有效（内核页面）
+#define PAGE_A    (1 << 6)  // 页被访问过
+#define PAGE_D    (1 << 7)  // 页被写入过
+#define PAGE_NOFREE (1 << 8) // 软件保留位：物理页不属于该进程（文件页、内嵌镜像页），释放时跳过
+#define PAGE_COW    (1 << 9) // 软件保留位：写时复制，写入时缺页再拷贝
+#define FORK_COPY_ALL 0      // 设为 1 时 fork 立即拷贝所有私有页面（与写时复制比较用的基线）
+#define MEMBENCH 0           // 设为 1 时启动时测量内核中 memset/memcpy 等函数的性能
+#define MEGAPAGE_SIZE (4 * 1024 * 1024) // Sv32 一级页表项可以直接映射 4MB 的大页
 #define USER_BASE 0x1000000
-#define FILES_MAX   2
-#define DISK_MAX_SIZE     align_up(sizeof(struct file) * FILES_MAX, SECTOR_SIZE)
+#define PAGE_ORDER_MAX 10   // 伙伴分配器的最大阶：一次最多分配 2^10 页（4MB）
+#define FILES_MAX      4096
+#define FILE_HASH_SIZE 4096                              // 文件名哈希表的桶数（2 的幂）
+#define FILE_SIZE_MAX  (PAGE_SIZE << PAGE_ORDER_MAX)     // 文件数据放在一块连续的物理页中
 #define SECTOR_SIZE       512
 #define VIRTQ_ENTRY_NUM   16
 #define VIRTIO_DEVICE_BLK 2
@@ -30,6 +80,8 @@
 #define VIRTIO_REG_QUEUE_ALIGN   0x3c
 #define VIRTIO_REG_QUEUE_PFN     0x40
 #define VIRTIO_REG_QUEUE_NOTIFY  0x50
+#define VIRTIO_REG_INTERRUPT_STATUS 0x60
+#define VIRTIO_REG_INTERRUPT_ACK    0x64
 #define VIRTIO_REG_DEVICE_STATUS 0x70
 #define VIRTIO_REG_DEVICE_CONFIG 0x100
 #define VIRTIO_STATUS_ACK       1
@@ -41,15 +93,219 @@
 #define VIRTQ_AVAIL_F_NO_INTERRUPT 1
 #define VIRTIO_BLK_T_IN  0
 #define VIRTIO_BLK_T_OUT 1
+#define BLK_REQ_MAX      (VIRTQ_ENTRY_NUM / 3)  // 同时在途的块设备请求数：每个请求占 3 个描述符
+#define BLK_SECTORS_MAX  128                    // 单个请求最多传输的扇区数（64KB）
+#define BCACHE_NUM       64                     // 块缓存中的扇区缓冲区个数
+#define BCACHE_HASH_SIZE 31                     // 块缓存哈希表的桶数
+#define VIRTIO_BLK_IRQ   1             // QEMU virt 机器上 virtio-mmio-bus.0 的中断号
+#define UART_PADDR       0x10000000    // QEMU virt 机器上 ns16550 串口的物理地址
+#define UART_IRQ         10            // 串口的中断号
+#define UART_RBR         0             // 接收缓冲寄存器（读）
+#define UART_IER         1             // 中断使能寄存器
+#define UART_MCR         4             // 调制解调器控制寄存器
+#define UART_LSR         5             // 线路状态寄存器
+#define UART_IER_RX      (1 << 0)      // 收到数据时产生中断
+#define UART_MCR_OUT2    (1 << 3)      // 部分 16550 需要置位 OUT2 才会把中断送出
+#define UART_LSR_DR      (1 << 0)      // 接收缓冲中有数据
+#define TTY_BUF_SIZE     256           // 控制台输入环形缓冲区的大小
+#define TRACE_ENTRIES    512           // 每个 hart 的跟踪环形缓冲区保存的记录数（2 的幂）
+#define TRACE_MAGIC      0x45435254    // 跟踪文件的魔数 "TRCE"
+#define TRACE_TRAP_ENTER 1             // 进入 handle_trap：arg0 = scause，arg1 = 系统调用号（其他陷入为 stval）
+#define TRACE_TRAP_EXIT  2             // 离开 handle_trap：arg0 = scause，arg1 = 系统调用的返回值
+#define TRACE_SWITCH     3             // yield 切换进程：记录的 pid 是切换到的进程，arg0 = 切换下来的进程
+#define TRACE_BLK_KICK   4             // 提交磁盘请求：arg0 = 槽位 | 扇区数 << 8 | 是否写 << 31，arg1 = 扇区号
+#define TRACE_BLK_DONE   5             // 磁盘请求完成：arg0 = 槽位，arg1 = 状态
+#define TRACE_FS_ENTER   6             // 开始文件系统操作：arg0 = TRACE_FS_*，arg1 = 文件在 files[] 中的序号
+#define TRACE_FS_EXIT    7             // 结束文件系统操作：arg0 = TRACE_FS_*，arg1 = 结果
+#define TRACE_FS_LOAD    1             // fs_load：从磁盘读入文件内容
+#define TRACE_FS_FLUSH   2             // fs_flush：写回修改过的文件
+#define TRACE_FS_READ    3             // fd_read
+#define TRACE_FS_WRITE   4             // fd_write
+#define PROFILE_FREQ     4000          // 剖析时每个 hart 每秒采样的次数
+#define PROFILE_ENTRIES  1024          // 每个 hart 的 PC 直方图的表项数
+#define PROFILE_MAGIC    0x464f5250    // 剖析文件的魔数 "PROF"
+#define PROC_NAME_MAX    16            // 进程名（程序名）的最大长度，包括 '\0'
+#define PLIC_PADDR       0x0c000000    // 平台级中断控制器 (PLIC) 的物理地址
+#define PLIC_PRIORITY(irq)    (PLIC_PADDR + (irq) * 4)                  // 中断源优先级
+#define PLIC_SENABLE(hart)    (PLIC_PADDR + 0x2080 + (hart) * 0x100)    // 该 hart 监管者模式的中断使能
+#define PLIC_STHRESHOLD(hart) (PLIC_PADDR + 0x201000 + (hart) * 0x2000) // 该 hart 监管者模式的优先级阈值
+#define PLIC_SCLAIM(hart)     (PLIC_PADDR + 0x201004 + (hart) * 0x2000) // 领取/完成中断
+
+struct file_desc { // 进程打开的文件
+    struct file *file; // NULL 表示该文件描述符未使用
+    size_t offset;     // 下一次读写的位置
+};
+
+struct vma { // 进程地址空间中按需映射的一段区域，发生缺页时才建立映射
+    int kind;          // VMA_FILE 等，0 表示未使用
+    vaddr_t start;     // 区域的起始地址（页对齐）
+    vaddr_t end;
+    uint32_t prot;     // 页面权限：PAGE_R / PAGE_W / PAGE_X
+    bool shared;       // 共享映射：直接映射文件的物理页，写入修改文件本身
+    struct file *file;
+    size_t offset;     // 区域起始处对应的文件偏移
+    const uint8_t *image; // VMA_IMAGE：区域起始处对应的镜像数据
+    size_t filesz;        // VMA_IMAGE：区域中有镜像数据的字节数
+};
+
+#define ELF_MAGIC   0x464c457f // "\x7fELF"
+#define EM_RISCV    243
+#define PT_LOAD     1
+#define PF_X        (1 << 0)
+#define PF_W        (1 << 1)
+#define PF_R        (1 << 2)
+
+struct elf32_ehdr { // ELF 文件头
+    uint32_t magic;
+    uint8_t ident[12];
+    uint16_t type;
+    uint16_t machine;
+    uint32_t version;
+    uint32_t entry;
+    uint32_t phoff;
+    uint32_t shoff;
+    uint32_t flags;
+    uint16_t ehsize;
+    uint16_t phentsize;
+    uint16_t phnum;
+    uint16_t shentsize;
+    uint16_t shnum;
+    uint16_t shstrndx;
+} __attribute__((packed));
+
+struct elf32_phdr { // ELF 程序头：描述一个需要加载到内存的段
+    uint32_t type;
+    uint32_t offset;
+    uint32_t vaddr;
+    uint32_t paddr;
+    uint32_t filesz;
+    uint32_t memsz;
+    uint32_t flags;
+    uint32_t align;
+} __attribute__((packed));
+
+struct wait_queue { // 等待某个事件的进程队列
+    struct process *head;
+};
+
+struct program { // 链接进内核的用户程序
+    const char *name;
+    const uint8_t *image;
+    size_t size;
+};
 
 struct process {
     int pid; // -1 if it's an idle process 闲置进程的 pid 是 -1
     int state; // PROC_UNUSED, PROC_RUNNABLE, PROC_EXITED
     vaddr_t sp; // kernel stack pointer
     uint32_t *page_table; // points to first level page table
+    uint32_t asid;            // 地址空间标识符，TLB 表项用它区分不同进程
+    uint32_t asid_generation; // 分配 asid 时的代数，与当前代数不同则 asid 已失效
+    struct process *run_next; // 就绪队列中的下一个进程
+    struct process *wait_next; // 等待队列中的下一个进程
+    struct process *timer_next; // 定时器队列中的下一个进程
+    uint64_t wake_time;        // sleep 结束的时刻（time 计数器的值）
+    struct cpu *cpu;           // 上一次在哪个 hart 上运行
+    struct process *parent;    // 父进程（fork 的调用者），父进程先退出时为 NULL
+    int children;              // 还没有退出的子进程数
+    int exited_children;       // 已经退出、还没有被 wait 的子进程数
+    struct wait_queue child_wait; // 在 wait 中等待子进程退出
+    struct file_desc fds[FDS_MAX]; // 文件描述符表
+    struct vma vmas[VMAS_MAX];     // 按需映射的区域
+    vaddr_t mmap_next;             // 下一次 mmap 使用的虚拟地址
+    unsigned resident_pages;       // 缺页时映射进来的用户页数
+    char name[PROC_NAME_MAX];      // 程序名，exec 时设置，fork 时继承
     uint8_t stack[8192]; // kernel stack 内核栈
 };
 
+struct spinlock { // 自旋锁：多个 hart 之间的互斥
+    volatile uint32_t locked;
+};
+
+struct trace_record { // 一条跟踪记录，24 字节；trace2json.py 按同样的格式解析
+    uint64_t time;     // time 计数器
+    uint16_t event;    // TRACE_*
+    uint16_t hart;
+    uint32_t pid;      // 当时在这个 hart 上运行的进程，空闲进程是 -1
+    uint32_t arg0;
+    uint32_t arg1;
+};
+
+struct profile_entry { // PC 直方图的一项：(pc, pid, 特权级) 被采样到的次数；prof2report.py 按同样的格式解析
+    uint32_t pc;
+    uint32_t count;               // 0 表示空闲的表项
+    uint16_t pid;                 // 空闲进程是 0xffff
+    uint8_t user;                 // 1 表示用户态，0 表示内核态
+    uint8_t reserved;
+    char name[PROC_NAME_MAX];     // 当时运行的程序，用来找到符号所在的 ELF 文件
+};
+
+struct profile_header { // 剖析文件的开头，后面紧跟 count 个表项
+    uint32_t magic;       // PROFILE_MAGIC
+    uint32_t freq;        // PROFILE_FREQ
+    uint32_t count;
+    uint32_t entry_size;  // sizeof(struct profile_entry)
+    uint32_t dropped;     // 直方图满了没能记录的采样数
+};
+
+struct trace_header { // 跟踪文件的开头，后面紧跟 count 条记录
+    uint32_t magic;       // TRACE_MAGIC
+    uint32_t timer_freq;  // time 计数器的频率
+    uint32_t count;
+    uint32_t record_size; // sizeof(struct trace_record)
+};
+
+/*
+ * 每个 hart 一个跟踪环形缓冲区，只有所属的 hart 写入，不需要加锁（陷入时拿到大内核锁之前也可以写）。
+ * 写满之后覆盖最老的记录。
+ */
+struct trace_ring {
+    volatile uint32_t head; // 下一条记录的序号，写完记录之后才增加
+    uint32_t tail;          // 下一次导出的起点，持有大内核锁时修改
+    struct trace_record records[TRACE_ENTRIES];
+};
+
+struct cpu { // 每个 hart 自己的调度状态，内核态时 tp 寄存器指向它
+    uint32_t hartid;
+    struct process *current;   // 正在运行的进程
+    struct process *idle;      // 空闲进程
+    struct process *runq_head; // 就绪队列（FIFO）：只包含可运行但不在运行中的进程
+    struct process *runq_tail;
+    uint32_t runq_len;
+    uint32_t asid_generation;  // 本 hart 的 TLB 已经刷新到的 ASID 代数
+    bool waiting;              // 空闲进程正在 wfi，有新的就绪进程时需要 IPI 唤醒
+    struct trace_ring trace;   // 本 hart 的跟踪记录
+    uint64_t timer_deadline;   // 调度需要的下一次定时器中断（时间片、睡眠的进程醒来）
+    uint64_t profile_next;     // 下一次剖析采样的时刻
+    uint32_t profile_dropped;
+    struct profile_entry profile[PROFILE_ENTRIES]; // 本 hart 的 PC 直方图，只有本 hart 写入
+};
+
+#define this_cpu() ({ struct cpu *__cpu; __asm__ __volatile__("mv %0, tp" : "=r"(__cpu)); __cpu; })
+#define current_proc (this_cpu()->current)
+#define idle_proc    (this_cpu()->idle)
+
+struct page {  // 物理页的描述符，伙伴分配器用它来管理空闲块
+    struct page *next; // 同一阶空闲链表中的下一个块（只在块首页有效）
+    struct page *prev;
+    uint8_t order;     // 块的阶：块大小为 2^order 页
+    bool free;         // 是否是空闲块的首页
+    uint16_t refs;     // 引用计数：fork 之后多个进程共享同一个用户页
+};
+
+struct sleeplock { // 拿不到锁时睡眠等待的锁，用于可能睡眠的长时间操作（如磁盘 I/O）
+    bool locked;
+    struct wait_queue waiters;
+};
+
+struct tty { // 控制台输入：串口中断把字符放进环形缓冲区，按行交给读取的进程
+    char buf[TTY_BUF_SIZE];
+    uint32_t read;   // 下一个被读取的位置
+    uint32_t commit; // 已经输入完成（回车）的行的结尾，read 到 commit 之间的字符可以读取
+    uint32_t edit;   // 正在编辑的行的结尾，commit 到 edit 之间的字符还可以用退格删除
+    struct wait_queue readers;
+};
+
 struct sbiret { // 系统调用返回值，错误码和返回值。
     long error;
     long value;
@@ -119,17 +375,41 @@ struct virtio_virtq {  // 完整的VirtIO虚拟队列
     struct virtq_used used __attribute__((aligned(PAGE_SIZE)));
     int queue_index;
     volatile uint16_t *used_index;
-    uint16_t last_used_index;
+    uint16_t last_used_index; // 已经回收到的 used ring 位置
+    uint16_t free_head;       // 空闲描述符链表的头
+    uint16_t num_free;        // 空闲描述符的个数
 } __attribute__((packed));
 
 struct virtio_blk_req {  // 定义块设备请求
     uint32_t type;
     uint32_t reserved;
     uint64_t sector;
-    uint8_t data[512];
-    uint8_t status;
+    uint8_t status;          // 数据不在请求里：描述符直接指向调用者的内存
 } __attribute__((packed));
 
+struct blk_batch { // 一批块设备请求：提交者等待 pending 归零
+    int pending;  // 还没完成的请求数
+    int errors;   // 失败的请求数
+};
+
+struct blk_slot { // 在途请求的内核侧信息，与 virtio_blk_req 池一一对应
+    bool in_use;
+    bool is_write;
+    struct blk_batch *batch; // 请求所属的批次
+};
+
+struct buf { // 块缓存中的一个扇区缓冲区
+    bool valid;              // data 中是否是磁盘上的有效内容
+    bool dirty;              // data 被修改过，还没有写回磁盘
+    bool busy;               // 正在被某个进程使用（bget/bread 到 brelse 之间），或正在进行 I/O
+    bool hashed;             // 在 bcache_hash 中（分配过扇区号），与 valid 无关
+    unsigned sector;
+    struct buf *hash_next;   // 同一个哈希桶中的下一个缓冲区
+    struct buf *lru_prev;    // LRU 链表：表头是最近使用的，表尾最先被淘汰
+    struct buf *lru_next;
+    uint8_t data[SECTOR_SIZE];
+};
+
 struct tar_header { // tar 归档文件的文件头信息
     char name[100];
     char mode[8];
@@ -154,8 +434,19 @@ struct tar_header { // tar 归档文件的文件头信息
 struct file {
     bool in_use;
     char name[100];
-    char data[1024];
+    uint8_t *data;       // 文件内容，按需分配的物理页，没有内容或还没加载时为 NULL
+    bool loaded;         // 文件内容是否已经从磁盘读入 data
+    size_t capacity;     // data 的容量（字节）
     size_t size;
+    struct file *hash_next;  // 文件名哈希表中同一个桶的下一个文件
+    struct file *dirty_next; // 待写回文件链表中的下一个文件
+    bool on_dirty_list;
+    int map_count;           // 映射了该文件的区域数，大于 0 时 data 不能被重新分配
+    unsigned sector;     // tar 头所在的扇区，数据紧跟在后面
+    unsigned nsectors;   // 磁盘上数据占用的扇区数
+    bool header_dirty;   // 文件大小等元数据改变，需要重写 tar 头
+    size_t dirty_start;  // 需要写回的数据范围 [dirty_start, dirty_end)
+    size_t dirty_end;
 };
 
 #define READ_CSR(reg)                                                          \
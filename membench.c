@@ -0,0 +1,9 @@
+#include "user.h"
+
+/* 用户态的 memset/memcpy/strcpy/strcmp 性能测试，结果与内核中 MEMBENCH 的输出对比 */
+uint8_t buf1[PAGE_SIZE + 4] __attribute__((aligned(4)));
+uint8_t buf2[PAGE_SIZE + 4] __attribute__((aligned(4)));
+
+void main(void) {
+    mem_bench(buf1, buf2, PAGE_SIZE);
+}
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+# Symbolize the sampling profile (profile.bin, written by "profile stop" in the shell)
+# against kernel.elf and the user program ELFs, and print a flat top-N report.
+#
+# usage: python3 prof2report.py [-n N] [disk.tar | profile.bin]
+# Run it from the directory where run.sh left kernel.elf, shell.elf and the *.elf programs.
+import argparse
+import bisect
+import collections
+import os
+import struct
+import sys
+import tarfile
+
+# Must match struct profile_header / struct profile_entry in kernel.h.
+HEADER = struct.Struct("<IIIII")
+ENTRY = struct.Struct("<IIHBB16s")
+PROFILE_MAGIC = 0x464F5250
+
+SHT_SYMTAB = 2
+STT_NOTYPE = 0
+STT_FUNC = 2
+
+
+def load(path):
+    if tarfile.is_tarfile(path):
+        with tarfile.open(path) as tar:
+            return tar.extractfile("profile.bin").read()
+    with open(path, "rb") as f:
+        return f.read()
+
+
+class Symbols:
+    """Function symbols from an ELF32 .symtab, sorted by address."""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            data = f.read()
+        shoff, = struct.unpack_from("<I", data, 0x20)
+        shentsize, shnum = struct.unpack_from("<HH", data, 0x2E)
+        sections = [struct.unpack_from("<10I", data, shoff + i * shentsize) for i in range(shnum)]
+
+        syms = []
+        for _, sh_type, _, _, offset, size, link, _, _, entsize in sections:
+            if sh_type != SHT_SYMTAB:
+                continue
+            strtab = sections[link][4]
+            for off in range(offset, offset + size, entsize):
+                name, value, sym_size, info, _, shndx = struct.unpack_from("<IIIBBH", data, off)
+                if info & 0xF not in (STT_FUNC, STT_NOTYPE) or shndx == 0:
+                    continue
+                end = data.index(b"\0", strtab + name)
+                label = data[strtab + name:end].decode()
+                if label and not label.startswith((".L", "$")):  # skip local and mapping symbols
+                    syms.append((value, sym_size, label))
+
+        syms.sort()
+        self.addrs = [s[0] for s in syms]
+        self.syms = syms
+
+    def lookup(self, pc):
+        i = bisect.bisect_right(self.addrs, pc) - 1
+        if i < 0:
+            return "0x%x" % pc
+        addr, size, name = self.syms[i]
+        if size and pc >= addr + size:
+            return "0x%x" % pc
+        return name
+
+
+def elf_for(entry_user, name):
+    if not entry_user:
+        return "kernel.elf"
+    return name if name.endswith(".elf") else name + ".elf"
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument("-n", type=int, default=20, help="number of functions to show")
+    parser.add_argument("path", nargs="?", default="disk.tar")
+    args = parser.parse_args()
+
+    data = load(args.path)
+    magic, freq, count, entry_size, dropped = HEADER.unpack_from(data, 0)
+    if magic != PROFILE_MAGIC or entry_size != ENTRY.size:
+        sys.exit("not a kernel profile dump")
+
+    symbols = {}
+    totals = collections.Counter()
+    total = 0
+    for i in range(count):
+        pc, samples, pid, user, _, name = ENTRY.unpack_from(data, HEADER.size + i * ENTRY.size)
+        name = name.split(b"\0")[0].decode()
+        elf = elf_for(user, name)
+        if elf not in symbols:
+            symbols[elf] = Symbols(elf) if os.path.exists(elf) else None
+        func = symbols[elf].lookup(pc) if symbols[elf] else "0x%x" % pc
+        where = "kernel" if not user else name
+        totals[(where, func)] += samples
+        total += samples
+
+    print("%d samples at %d Hz per hart, %d dropped" % (total, freq, dropped))
+    print("%8s %7s  %-12s %s" % ("samples", "%", "where", "function"))
+    for (where, func), samples in totals.most_common(args.n):
+        print("%8d %6.1f%%  %-12s %s" % (samples, 100.0 * samples / total, where, func))
+
+
+if __name__ == "__main__":
+    main()
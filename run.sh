@@ -9,16 +9,32 @@ CFLAGS="-std=c11 -O2 -g3 -Wall -Wextra --target=riscv32 -ffreestanding -nostdlib
 
 # Build the shell.
 $CC $CFLAGS -Wl,-Tuser.ld -Wl,-Map=shell.map -o shell.elf shell.c user.c common.c
-$OBJCOPY --set-section-flags .bss=alloc,contents -O binary shell.elf shell.bin
-$OBJCOPY -Ibinary -Oelf32-littleriscv shell.bin shell.bin.o
+# Embed the ELF image itself; page-align it so read-only segments can be mapped in place.
+$OBJCOPY -Ibinary -Oelf32-littleriscv --set-section-alignment .data=4096 shell.elf shell.elf.o
+
+# Build the programs loaded from disk by exec.
+PROGRAMS="hello membench smpbench syscallbench ctxbench allocbench fsbench forkbench"
+for prog in $PROGRAMS; do
+    $CC $CFLAGS -Wl,-Tuser.ld -o $prog.elf $prog.c user.c common.c
+done
 
 # Build the kernel.
 $CC $CFLAGS -Wl,-Tkernel.ld -Wl,-Map=kernel.map -o kernel.elf \
-    kernel.c common.c shell.bin.o
+    kernel.c common.c shell.elf.o
+
+(cd disk && tar cf ../disk.tar --format=ustar *.txt *.bin -C .. ${PROGRAMS// /.elf }.elf)
+# Leave room after the archive so files (e.g. the trace.bin dump) can grow. dd sets the
+# size to exactly 4 MiB, so only pad smaller archives; a larger one must not be cut off.
+if [ "$(wc -c < disk.tar)" -lt 4194304 ]; then
+    dd if=/dev/zero of=disk.tar bs=1048576 count=0 seek=4
+fi
 
-(cd disk && tar cf ../disk.tar --format=ustar *.txt)
+# bench.py only needs the build; it boots QEMU itself.
+if [ -n "${BUILD_ONLY:-}" ]; then
+    exit 0
+fi
 
-$QEMU -machine virt -bios default -nographic -serial mon:stdio --no-reboot \
+$QEMU -machine virt -smp ${SMP:-4} -bios default -nographic -serial mon:stdio --no-reboot \
     -d unimp,guest_errors,int,cpu_reset -D qemu.log \
     -drive id=drive0,file=disk.tar,format=raw,if=none \
     -device virtio-blk-device,drive=drive0,bus=virtio-mmio-bus.0 \
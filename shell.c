@@ -1,32 +1,85 @@
 #include "user.h"
 
 /* 实现一个简单的命令行 shell 程序 
- * 这个 shell 实现了四个功能：
+ * 这个 shell 实现了九个功能：
  * 1. hello：打印 hello 信息
  * 2. exit：退出 shell
  * 3. readfile：读取hello.txt文件内容
  * 4. writefile：往hello.txt文件写内容
+ * 5. fork：创建一个子进程，子进程打印信息后退出
+ * 6. sleep：睡眠 1 秒
+ * 7. stats：打印内核的性能计数器并清零（stats keep 不清零）
+ * 8. trace：把内核的跟踪记录导出到 trace.bin，在主机上用 trace2json.py 转换
+ * 9. profile start / profile stop：采样剖析，停止时导出到 profile.bin，在主机上用 prof2report.py 生成报告
+ * 其他命令当作程序名，在子进程中 exec 运行并等待它结束（内嵌的程序或者磁盘上的 ELF 文件，例如 hello.elf、smpbench.elf）
 */
 
+const char *syscall_names[STATS_SYSCALLS] = {
+    [SYS_PUTCHAR] = "putchar", [SYS_GETCHAR] = "getchar", [SYS_EXIT] = "exit",
+    [SYS_READFILE] = "readfile", [SYS_WRITEFILE] = "writefile", [SYS_OPEN] = "open",
+    [SYS_READ] = "read", [SYS_WRITE] = "write", [SYS_LSEEK] = "lseek", [SYS_CLOSE] = "close",
+    [SYS_MMAP] = "mmap", [SYS_MUNMAP] = "munmap", [SYS_FORK] = "fork", [SYS_EXEC] = "exec",
+    [SYS_SLEEP] = "sleep", [SYS_WAIT] = "wait", [SYS_STATS] = "stats", [SYS_TRACE] = "trace",
+    [SYS_PROFILE] = "profile", [SYS_GETPID] = "getpid", [SYS_YIELD] = "yield",
+};
+
+uint32_t div64(uint64_t n, uint32_t d) { // 64 位除以 32 位，结果截断到 32 位（没有链接 libgcc 的 __udivdi3）
+    uint64_t q = 0, r = 0;
+    for (int i = 63; i >= 0; i--) {
+        r = (r << 1) | ((n >> i) & 1);
+        if (r >= d) {
+            r -= d;
+            q |= 1ull << i;
+        }
+    }
+    return (uint32_t) q;
+}
+
+void print_latency(const char *name, struct latency_stat *stat) { // 耗时以 0.1 微秒为单位，打印成 x.y us
+    uint32_t avg = div64(stat->total, stat->count);
+    printf("%s: count=%d avg=%d.%d min=%d.%d max=%d.%d us\n", name, stat->count,
+           avg / 10, avg % 10, stat->min / 10, stat->min % 10, stat->max / 10, stat->max % 10);
+    printf("  histogram (>= ticks: count):");
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        if (stat->hist[i])
+            printf(" %d:%d", i ? 1 << i : 0, stat->hist[i]);
+    }
+    printf("\n");
+}
+
+void print_stats(int flags) {
+    struct kernel_stats ks;
+    if (stats(&ks, flags) < 0) {
+        printf("stats failed\n");
+        return;
+    }
+
+    for (int i = 0; i < STATS_SYSCALLS; i++) {
+        if (ks.syscalls[i].count)
+            print_latency(syscall_names[i] ? syscall_names[i] : "(unknown)", &ks.syscalls[i]);
+    }
+    if (ks.interrupts.count)
+        print_latency("interrupts", &ks.interrupts);
+    if (ks.page_faults.count)
+        print_latency("page faults", &ks.page_faults);
+    printf("context switches: %d\n", ks.context_switches);
+    printf("disk requests: %d (%d sectors)\n", ks.disk_requests, ks.disk_sectors);
+    printf("page allocations: %d (%d pages)\n", ks.page_allocs, ks.pages_allocated);
+    printf("fork: %d of %d resident pages copied\n", ks.fork_pages_copied, ks.fork_pages);
+}
+
 void main(void) {
     while (1) { // 无限循环处理用户输入
-prompt:
         printf("> ");
         char cmdline[128];
-        for (int i = 0;; i++) {
-            char ch = getchar();
-            putchar(ch); // 回显字符
-            if (i == sizeof(cmdline) - 1) {
-                printf("command line too long\n");
-                goto prompt;
-            } else if (ch == '\r') { // \r 表示回车符，命令结束， break
-                printf("\n");
-                cmdline[i] = '\0'; // 添加字符串结束符 \0
-                break;
-            } else {
-                cmdline[i] = ch;
-            }
+        int len = read(STDIN_FILENO, cmdline, sizeof(cmdline)); // 内核负责回显和退格，回车之后一次读到一整行
+        if (len <= 0 || cmdline[len - 1] != '\n') {
+            printf("command line too long\n");
+            while (len > 0 && cmdline[len - 1] != '\n') // 丢弃这一行剩下的部分
+                len = read(STDIN_FILENO, cmdline, sizeof(cmdline));
+            continue;
         }
+        cmdline[len - 1] = '\0'; // 把换行替换成字符串结束符 \0
 
         if (strcmp(cmdline, "hello") == 0)
             printf("Hello world from shell!\n");
@@ -40,7 +93,48 @@ prompt:
         }
         else if (strcmp(cmdline, "writefile") == 0)
             writefile("hello.txt", "Hello from shell!\n", 19);
-        else
-            printf("unknown command: %s\n", cmdline);
+        else if (strcmp(cmdline, "sleep") == 0)
+            sleep(1000);
+        else if (strcmp(cmdline, "stats") == 0)
+            print_stats(STATS_RESET);
+        else if (strcmp(cmdline, "stats keep") == 0)
+            print_stats(0);
+        else if (strcmp(cmdline, "trace") == 0) {
+            int count = trace_dump("trace.bin");
+            if (count < 0)
+                printf("trace failed\n");
+            else
+                printf("dumped %d trace records to trace.bin\n", count);
+        }
+        else if (strcmp(cmdline, "profile start") == 0)
+            profile(PROFILE_START, NULL);
+        else if (strcmp(cmdline, "profile stop") == 0) {
+            int count = profile(PROFILE_DUMP, "profile.bin");
+            if (count < 0)
+                printf("profile failed\n");
+            else
+                printf("dumped %d profile entries to profile.bin\n", count);
+        }
+        else if (strcmp(cmdline, "fork") == 0) {
+            int pid = fork();
+            if (pid == 0) {
+                printf("Hello from child!\n");
+                exit();
+            } else if (pid < 0)
+                printf("fork failed\n");
+            else
+                wait();
+        }
+        else {
+            int pid = fork();
+            if (pid == 0) {
+                exec(cmdline);
+                printf("unknown command: %s\n", cmdline);
+                exit();
+            } else if (pid < 0)
+                printf("fork failed\n");
+            else
+                wait(); // 程序结束之后再显示提示符
+        }
     }
 }
@@ -0,0 +1,31 @@
+#include "user.h"
+
+/* 多核吞吐量测试：同时运行 n 个计算密集的进程，每个进程的工作量相同，
+ * 比较总的完成时间。n 个进程分布在 n 个 hart 上时，时间应该与 1 个进程接近。 */
+#define WORK  20000000
+#define TICKS_PER_MS 10000 // time 计数器是 10MHz
+
+void spin(void) {
+    volatile uint32_t sum = 0;
+    for (uint32_t i = 0; i < WORK; i++)
+        sum += i;
+}
+
+void main(void) {
+    for (int n = 1; n <= 8; n *= 2) {
+        uint32_t start = READ_TIME();
+        for (int i = 0; i < n; i++) {
+            if (fork() == 0) {
+                spin();
+                exit();
+            }
+        }
+        while (wait() == 0)
+            ;
+
+        uint32_t ms = (READ_TIME() - start) / TICKS_PER_MS;
+        uint32_t rate = n * (WORK / 1000) / (ms ? ms : 1) * 1000;
+        printf("smpbench: %d procs in %d ms, %d iterations/ms\n", n, ms, rate);
+        printf("bench: smp_%dprocs %d iterations/ms\n", n, rate);
+    }
+}
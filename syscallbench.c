@@ -0,0 +1,21 @@
+#include "user.h"
+
+/* 系统调用开销：空系统调用（getpid）的延迟，以及逐个字符输出（SYS_PUTCHAR）的吞吐量。
+ * 结果按 "bench: 名称 数值 单位" 的格式输出，由 bench.py 解析。 */
+#define NULL_CALLS   10000
+#define PUTCHARS     2000
+#define TICKS_PER_MS 10000 // time 计数器是 10MHz，一个 tick 是 100ns
+
+void main(void) {
+    uint32_t start = READ_TIME();
+    for (int i = 0; i < NULL_CALLS; i++)
+        getpid();
+    uint32_t ticks = READ_TIME() - start;
+    printf("bench: null_syscall %d ns\n", ticks / (NULL_CALLS / 100));
+
+    start = READ_TIME();
+    for (int i = 0; i < PUTCHARS; i++)
+        putchar(i % 64 == 63 ? '\n' : '.');
+    ticks = READ_TIME() - start;
+    printf("bench: putchar %d chars/ms\n", PUTCHARS * TICKS_PER_MS / (ticks ? ticks : 1));
+}
@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+# Convert the kernel trace dump (trace.bin, written by the shell's "trace" command)
+# into Chrome trace JSON, viewable in chrome://tracing or https://ui.perfetto.dev.
+#
+# usage: python3 trace2json.py [disk.tar | trace.bin] > trace.json
+import json
+import struct
+import sys
+import tarfile
+
+# Must match struct trace_header / struct trace_record in kernel.h.
+HEADER = struct.Struct("<IIII")
+RECORD = struct.Struct("<QHHiII")
+TRACE_MAGIC = 0x45435254
+
+TRACE_TRAP_ENTER = 1
+TRACE_TRAP_EXIT = 2
+TRACE_SWITCH = 3
+TRACE_BLK_KICK = 4
+TRACE_BLK_DONE = 5
+TRACE_FS_ENTER = 6
+TRACE_FS_EXIT = 7
+
+FS_OPS = {1: "fs_load", 2: "fs_flush", 3: "fd_read", 4: "fd_write"}
+
+# Syscall numbers from common.h.
+SYSCALLS = {
+    1: "putchar", 2: "getchar", 3: "exit", 4: "readfile", 5: "writefile",
+    6: "open", 7: "read", 8: "write", 9: "lseek", 10: "close", 11: "mmap",
+    12: "munmap", 13: "fork", 14: "exec", 15: "sleep", 16: "wait",
+    17: "stats", 18: "trace", 19: "profile", 20: "getpid", 21: "yield",
+}
+
+SCAUSE_INTERRUPT = 1 << 31
+SCAUSE_ECALL = 8
+INTERRUPTS = {1: "ipi", 5: "timer irq", 9: "external irq"}
+EXCEPTIONS = {12: "inst page fault", 13: "load page fault", 15: "store page fault"}
+
+KERNEL_PID = 0  # Chrome "process" holding one thread per user process
+HARTS_PID = 1   # Chrome "process" holding one thread per hart
+DISK_PID = 2
+
+
+def load(path):
+    if tarfile.is_tarfile(path):
+        with tarfile.open(path) as tar:
+            return tar.extractfile("trace.bin").read()
+    with open(path, "rb") as f:
+        return f.read()
+
+
+def trap_name(scause, arg):
+    if scause & SCAUSE_INTERRUPT:
+        return INTERRUPTS.get(scause & ~SCAUSE_INTERRUPT, "irq %d" % (scause & ~SCAUSE_INTERRUPT))
+    if scause == SCAUSE_ECALL:
+        return SYSCALLS.get(arg, "syscall %d" % arg)
+    return EXCEPTIONS.get(scause, "trap %d" % scause)
+
+
+def thread_name(pid):
+    return "idle" if pid < 0 else "pid %d" % pid
+
+
+def convert(data):
+    magic, freq, count, record_size = HEADER.unpack_from(data, 0)
+    if magic != TRACE_MAGIC or record_size != RECORD.size:
+        sys.exit("not a kernel trace dump")
+
+    records = [RECORD.unpack_from(data, HEADER.size + i * RECORD.size) for i in range(count)]
+    records.sort(key=lambda r: r[0])  # each hart's ring is in order; merge them
+    if not records:
+        return []
+
+    t0 = records[0][0]
+    ts = lambda t: (t - t0) * 1e6 / freq  # microseconds
+    events = []
+    open_slices = {}  # tid -> stack of slice names, to drop exits whose entry was overwritten
+    running = {}      # hart -> (pid, start time) of the process running on it
+    disk = {}         # request slot -> name of the in-flight request
+    pids = set()
+
+    def begin(tid, name, t, args):
+        open_slices.setdefault(tid, []).append(name)
+        events.append({"ph": "B", "pid": KERNEL_PID, "tid": tid, "name": name, "ts": ts(t), "args": args})
+
+    def end(tid, t, args):
+        if open_slices.get(tid):
+            name = open_slices[tid].pop()
+            events.append({"ph": "E", "pid": KERNEL_PID, "tid": tid, "name": name, "ts": ts(t), "args": args})
+
+    for time, event, hart, pid, arg0, arg1 in records:
+        pids.add(pid)
+        if event == TRACE_TRAP_ENTER:
+            begin(pid, trap_name(arg0, arg1), time, {"hart": hart, "scause": hex(arg0), "arg": hex(arg1)})
+        elif event == TRACE_TRAP_EXIT:
+            end(pid, time, {"hart": hart, "ret": arg1 - (1 << 32) if arg1 >> 31 else arg1})
+        elif event == TRACE_FS_ENTER:
+            begin(pid, FS_OPS.get(arg0, "fs %d" % arg0), time, {"hart": hart, "file": arg1})
+        elif event == TRACE_FS_EXIT:
+            end(pid, time, {"hart": hart, "result": arg1 - (1 << 32) if arg1 >> 31 else arg1})
+        elif event == TRACE_SWITCH:
+            prev_pid = arg0 - (1 << 32) if arg0 >> 31 else arg0
+            start = running.get(hart, (prev_pid, t0))[1]
+            events.append({"ph": "X", "pid": HARTS_PID, "tid": hart, "name": thread_name(prev_pid),
+                           "ts": ts(start), "dur": ts(time) - ts(start)})
+            running[hart] = (pid, time)
+        elif event == TRACE_BLK_KICK:
+            slot, sectors, write = arg0 & 0xff, (arg0 >> 8) & 0x7fffff, arg0 >> 31
+            name = "%s %d+%d" % ("write" if write else "read", arg1, sectors)
+            disk[slot] = name
+            events.append({"ph": "b", "cat": "disk", "id": slot, "pid": DISK_PID, "tid": 0,
+                           "name": name, "ts": ts(time), "args": {"hart": hart, "pid": pid}})
+        elif event == TRACE_BLK_DONE:
+            if arg0 in disk:
+                events.append({"ph": "e", "cat": "disk", "id": arg0, "pid": DISK_PID, "tid": 0,
+                               "name": disk.pop(arg0), "ts": ts(time), "args": {"status": arg1}})
+
+    last = records[-1][0]
+    for hart, (pid, start) in running.items():
+        events.append({"ph": "X", "pid": HARTS_PID, "tid": hart, "name": thread_name(pid),
+                       "ts": ts(start), "dur": ts(last) - ts(start)})
+
+    meta = [
+        {"ph": "M", "pid": KERNEL_PID, "name": "process_name", "args": {"name": "processes"}},
+        {"ph": "M", "pid": HARTS_PID, "name": "process_name", "args": {"name": "harts"}},
+        {"ph": "M", "pid": DISK_PID, "name": "process_name", "args": {"name": "virtio-blk"}},
+    ]
+    for pid in sorted(pids):
+        meta.append({"ph": "M", "pid": KERNEL_PID, "tid": pid, "name": "thread_name",
+                     "args": {"name": thread_name(pid)}})
+    for hart in sorted(running):
+        meta.append({"ph": "M", "pid": HARTS_PID, "tid": hart, "name": "thread_name",
+                     "args": {"name": "hart %d" % hart}})
+    return meta + events
+
+
+def main():
+    path = sys.argv[1] if len(sys.argv) > 1 else "disk.tar"
+    json.dump({"traceEvents": convert(load(path)), "displayTimeUnit": "ns"}, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
@@ -21,6 +21,10 @@ void putchar(char ch) {
     syscall(SYS_PUTCHAR, ch, 0, 0);
 }
 
+void console_write(const char *buf, size_t len) { // printf 的输出：一次系统调用写出整个缓冲区
+    write(STDOUT_FILENO, buf, len);
+}
+
 int getchar(void) {
     return syscall(SYS_GETCHAR, 0, 0, 0);
 }
@@ -33,6 +37,71 @@ int writefile(const char *filename, const char *buf, int len) {
     return syscall(SYS_WRITEFILE, (int) filename, (int) buf, len);
 }
 
+int open(const char *filename) {
+    return syscall(SYS_OPEN, (int) filename, 0, 0);
+}
+
+int read(int fd, void *buf, int len) {
+    return syscall(SYS_READ, fd, (int) buf, len);
+}
+
+int write(int fd, const void *buf, int len) {
+    return syscall(SYS_WRITE, fd, (int) buf, len);
+}
+
+int lseek(int fd, int offset, int whence) {
+    return syscall(SYS_LSEEK, fd, offset, whence);
+}
+
+int close(int fd) {
+    return syscall(SYS_CLOSE, fd, 0, 0);
+}
+
+void *mmap(int fd, int len, int flags) {
+    int addr = syscall(SYS_MMAP, fd, len, flags);
+    return addr == -1 ? NULL : (void *) addr;
+}
+
+int munmap(void *addr) {
+    return syscall(SYS_MUNMAP, (int) addr, 0, 0);
+}
+
+int fork(void) {
+    return syscall(SYS_FORK, 0, 0, 0);
+}
+
+int exec(const char *name) {
+    return syscall(SYS_EXEC, (int) name, 0, 0);
+}
+
+int wait(void) {
+    return syscall(SYS_WAIT, 0, 0, 0);
+}
+
+int getpid(void) {
+    return syscall(SYS_GETPID, 0, 0, 0);
+}
+
+void yield(void) {
+    syscall(SYS_YIELD, 0, 0, 0);
+}
+
+void sleep(int ms) {
+    syscall(SYS_SLEEP, ms, 0, 0);
+}
+
+int stats(struct kernel_stats *buf, int flags) {
+    return syscall(SYS_STATS, (int) buf, sizeof(*buf), flags);
+}
+
+int trace_dump(const char *filename) {
+    return syscall(SYS_TRACE, (int) filename, 0, 0);
+}
+
+int profile(int op, const char *filename) {
+    return syscall(SYS_PROFILE, op, (int) filename, 0);
+}
+
 __attribute__((noreturn)) void exit(void) { // __attribute__((noreturn)) 表示函数不会返回调用它的地方。
     syscall(SYS_EXIT, 0, 0, 0);
     for (;;); // 保证syscall之后不会执行别的代码，理论上上一行会退出，不会走到这个for无限循环，写这个循环是为了什么防止上面没有终止代码走下来。
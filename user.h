@@ -9,7 +9,23 @@ struct sysret {  // 系统调用返回值结构，用于有多个返回值的系
 };
 
 void putchar(char ch); // 用户程序的标准输出函数
-int getchar(void);     // 用户程序的标准输入接口，返回读取的字符
+int getchar(void);     // 从控制台读取一个字符。输入按行缓冲：整行回车提交之前会一直等待，之后逐个返回这一行的字符（包括换行）
 int readfile(const char *filename, char *buf, int len);  // 文件读取系统调用，返回读取到的文件的字节数
-int writefile(const char *filename, const char *buf, int len);  // 文件写入系统调用，返回实际写入的字节数 
+int writefile(const char *filename, const char *buf, int len);  // 文件写入系统调用，返回实际写入的字节数，写回磁盘失败返回 -1
+int open(const char *filename);                  // 打开文件，返回文件描述符，失败返回 -1
+int read(int fd, void *buf, int len);            // 从当前位置读取最多 len 字节，返回读到的字节数；STDIN_FILENO 一次读取控制台的一行
+int write(int fd, const void *buf, int len);     // 从当前位置写入 len 字节，文件会按需变长
+int lseek(int fd, int offset, int whence);       // 移动读写位置（SEEK_SET/SEEK_CUR/SEEK_END），返回新的位置
+int close(int fd);                               // 关闭文件，修改的部分写回磁盘，写回失败返回 -1
+void *mmap(int fd, int len, int flags);          // 把文件映射到地址空间（PROT_* | MAP_SHARED），失败返回 NULL
+int munmap(void *addr);                          // 解除 mmap 建立的映射，共享映射中写过的页写回磁盘，写回失败返回 -1
+int fork(void);                                  // 复制当前进程，子进程返回 0，父进程返回子进程的 pid，失败返回 -1
+int exec(const char *name);                      // 把当前进程替换为内嵌的或磁盘上的 ELF 程序，成功时不返回，失败返回 -1
+int wait(void);                                  // 等待一个子进程退出，没有子进程时返回 -1
+int getpid(void);                                // 返回当前进程的 pid
+void yield(void);                                // 让出 CPU，排到就绪队列末尾
+void sleep(int ms);                              // 睡眠至少 ms 毫秒，期间不占用 CPU
+int stats(struct kernel_stats *buf, int flags);  // 读取内核的性能计数器，flags 为 STATS_RESET 时同时清零，失败返回 -1
+int trace_dump(const char *filename);            // 把内核的跟踪记录导出到已存在的文件，返回记录条数，失败返回 -1
+int profile(int op, const char *filename);       // 采样剖析：PROFILE_START/PROFILE_STOP，PROFILE_DUMP 导出到已存在的文件并返回表项数
 __attribute__((noreturn)) void exit(void); // 进程退出系统调用